@@ -0,0 +1,101 @@
+#ifndef QUBES_WAYLAND_COMPOSITOR_BENCH_H
+#define QUBES_WAYLAND_COMPOSITOR_BENCH_H                                       \
+	_Pragma("GCC error \"double-include guard referenced\"")
+
+/*
+ * In-process stand-ins for the parts of the compositor that need Xen: the
+ * Rust vchan code and the gntalloc allocator.  They are linked into the
+ * benchmarks instead of the real ones.  Also synthetic clients for the
+ * benchmarks to drive.
+ */
+
+#include "common.h"
+#include <wlr/render/allocator.h>
+#include <wlr/util/box.h>
+
+#include "qubes_output.h"
+
+struct qubes_rust_backend;
+struct tinywl_server;
+
+/* Traffic seen by the fake vchan */
+struct qubes_bench_vchan_stats {
+	uint64_t messages, bytes;
+	uint64_t dumps; /* MSG_WINDOW_DUMP */
+};
+
+void qubes_bench_vchan_stats(struct qubes_rust_backend *backend,
+                             struct qubes_bench_vchan_stats *stats);
+
+/**
+ * Acknowledge every MSG_WINDOW_DUMP sent so far, as a GUI daemon that keeps
+ * up would.
+ */
+void qubes_bench_vchan_ack_dumps(struct qubes_rust_backend *backend,
+                                 struct tinywl_server *server);
+
+/* Buffers created by the fake allocator so far */
+uint64_t qubes_bench_allocations(struct wlr_allocator *alloc);
+
+/* Pages of the grant buffers that are currently allocated */
+uint64_t qubes_bench_allocated_pages(struct wlr_allocator *alloc);
+
+/*
+ * A synthetic client: a scene buffer in the scene of a real qubes_output.
+ * A frame changes a rectangle of the client's pixels, damages it in the
+ * scene and sends a frame event to the output, which goes through
+ * wlr_scene_output_commit(), qubes_output_commit() and qubes_output_damage()
+ * to the fake vchan, exactly as a surface commit would.  If the window is
+ * composited, a small rectangle on top forces the scene to be rendered with
+ * pixman instead of the client buffer being scanned out.
+ */
+struct qubes_bench_window {
+	struct qubes_output output;
+	struct wlr_buffer *buffer; /* the client's buffer */
+	struct wlr_scene_buffer *scene_buffer;
+	struct wlr_scene_rect *overlay; /* only if composited */
+};
+
+uint64_t qubes_bench_now_ns(void);
+
+/*
+ * Option parsing.  Each exits with an error naming what was expected if str
+ * is not valid.  qubes_bench_parse_prefix() parses a number at the start of
+ * str and stores where it ends in end, qubes_bench_parse_count() requires
+ * the whole string to be a number, and qubes_bench_parse_size() parses
+ * WIDTHxHEIGHT.
+ */
+uint32_t qubes_bench_parse_prefix(const char *str, char **end,
+                                  const char *what);
+uint32_t qubes_bench_parse_count(const char *str, const char *what);
+void qubes_bench_parse_size(const char *str, const char *what,
+                            uint32_t *width, uint32_t *height);
+
+/*
+ * A server with the fake vchan and allocator, connected to a daemon that
+ * speaks protocol 1.7.  There is no seat and no Wayland socket.
+ */
+struct tinywl_server *qubes_bench_server_create(void);
+void qubes_bench_server_destroy(struct tinywl_server *server);
+
+struct qubes_bench_window *
+qubes_bench_window_create(struct tinywl_server *server, struct wlr_box box,
+                          bool override_redirect, bool composite);
+void qubes_bench_window_destroy(struct qubes_bench_window *window);
+
+/* Draw a frame and commit it.  Returns how long the commit took in ns. */
+uint64_t qubes_bench_window_frame(struct qubes_bench_window *window,
+                                  uint32_t damage_width,
+                                  uint32_t damage_height, uint32_t frame);
+
+/* Give the client a buffer of a new size, as after a MSG_CONFIGURE */
+void qubes_bench_window_resize(struct qubes_bench_window *window,
+                               uint32_t width, uint32_t height);
+
+/* First pixel of what was last sent to the daemon for the window */
+uint32_t qubes_bench_window_sent_pixel(struct qubes_bench_window *window);
+/* The pixel that qubes_bench_window_frame() draws at (0, 0) */
+uint32_t qubes_bench_frame_pixel(uint32_t frame);
+
+#endif
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
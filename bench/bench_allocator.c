@@ -0,0 +1,191 @@
+// Fake of the gntalloc allocator, for benchmarking
+
+#include "common.h"
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <wlr/interfaces/wlr_buffer.h>
+#include <wlr/render/allocator.h>
+#include <wlr/render/drm_format_set.h>
+#include <wlr/types/wlr_buffer.h>
+#include <wlr/util/log.h>
+
+#include <drm_fourcc.h>
+#include <qubes-gui-protocol.h>
+
+#include "bench.h"
+#include "qubes_allocator.h"
+
+#ifndef XC_PAGE_SIZE
+#define XC_PAGE_SIZE 4096
+#endif
+
+/*
+ * Buffers are memfd mappings laid out like real grant buffers, including the
+ * grant ref array that MSG_WINDOW_DUMP sends, so the compositor cannot tell
+ * the difference.  There is no pool: every buffer counts as an allocation.
+ */
+struct qubes_allocator {
+	struct wlr_allocator inner;
+	uint64_t allocations;
+	uint64_t buffers; /* live buffers */
+	uint64_t pages;   /* pages of the live buffers */
+};
+
+static struct wlr_buffer *
+qubes_bench_buffer_create(struct wlr_allocator *alloc, const int width,
+                          const int height, const struct wlr_drm_format *format);
+static void qubes_bench_allocator_destroy(struct wlr_allocator *alloc);
+
+static const struct wlr_allocator_interface qubes_bench_allocator_impl = {
+	.create_buffer = qubes_bench_buffer_create,
+	.destroy = qubes_bench_allocator_destroy,
+};
+
+static bool qubes_bench_begin_data_ptr_access(struct wlr_buffer *raw_buffer,
+                                              uint32_t flags, void **data,
+                                              uint32_t *format, size_t *stride)
+{
+	assert(raw_buffer->impl == qubes_buffer_impl_addr);
+	if (flags & ~((uint32_t)WLR_BUFFER_DATA_PTR_ACCESS_READ |
+	              (uint32_t)WLR_BUFFER_DATA_PTR_ACCESS_WRITE))
+		return false;
+	struct qubes_buffer *buffer = wl_container_of(raw_buffer, buffer, inner);
+	if (stride)
+		*stride = buffer->qubes.width * sizeof(uint32_t);
+	if (data)
+		*data = buffer->ptr;
+	if (format)
+		*format = buffer->format;
+	return true;
+}
+
+static void qubes_bench_end_data_ptr_access(struct wlr_buffer *raw_buffer
+                                            __attribute__((unused)))
+{}
+
+static const struct wlr_buffer_impl qubes_bench_buffer_impl = {
+	.destroy = qubes_buffer_destroy,
+	.get_dmabuf = NULL,
+	.get_shm = NULL,
+	.begin_data_ptr_access = qubes_bench_begin_data_ptr_access,
+	.end_data_ptr_access = qubes_bench_end_data_ptr_access,
+};
+const struct wlr_buffer_impl *qubes_buffer_impl_addr = &qubes_bench_buffer_impl;
+
+struct wlr_allocator *qubes_allocator_create(uint16_t domid
+                                             __attribute__((unused)))
+{
+	struct qubes_allocator *qalloc = calloc(sizeof(*qalloc), 1);
+	if (!qalloc)
+		return NULL;
+	wlr_allocator_init(&qalloc->inner, &qubes_bench_allocator_impl,
+	                   WLR_BUFFER_CAP_DATA_PTR);
+	return &qalloc->inner;
+}
+
+static void qubes_bench_allocator_destroy(struct wlr_allocator *alloc)
+{
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	if (qalloc->buffers)
+		wlr_log(WLR_ERROR, "%" PRIu64 " buffers leaked", qalloc->buffers);
+	else
+		free(qalloc);
+}
+
+void qubes_allocator_set_pool_enabled(struct wlr_allocator *alloc
+                                      __attribute__((unused)),
+                                      bool enabled __attribute__((unused)))
+{}
+
+void qubes_allocator_log_stats(struct wlr_allocator *alloc)
+{
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	wlr_log(WLR_ERROR, "Fake grants: %" PRIu64 " buffers, %" PRIu64 " created",
+	        qalloc->buffers, qalloc->allocations);
+}
+
+uint64_t qubes_bench_allocations(struct wlr_allocator *alloc)
+{
+	assert(alloc->impl == &qubes_bench_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	return qalloc->allocations;
+}
+
+uint64_t qubes_bench_allocated_pages(struct wlr_allocator *alloc)
+{
+	assert(alloc->impl == &qubes_bench_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	return qalloc->pages;
+}
+
+static struct wlr_buffer *
+qubes_bench_buffer_create(struct wlr_allocator *alloc, const int width,
+                          const int height, const struct wlr_drm_format *format)
+{
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	if (width < 1 || width > MAX_WINDOW_WIDTH || height < 1 ||
+	    height > MAX_WINDOW_HEIGHT ||
+	    (format->format != DRM_FORMAT_XRGB8888 &&
+	     format->format != DRM_FORMAT_ARGB8888))
+		return NULL;
+
+	const size_t bytes = (size_t)width * (size_t)height * sizeof(uint32_t);
+	const uint32_t pages = NUM_PAGES(bytes);
+	struct qubes_buffer *buffer =
+	   calloc((size_t)pages * SIZEOF_GRANT_REF +
+	             offsetof(struct qubes_buffer, qubes) + sizeof(buffer->qubes),
+	          1);
+	if (!buffer)
+		return NULL;
+	int fd = memfd_create("qubes-bench-buffer", MFD_CLOEXEC);
+	if (fd == -1)
+		goto fail;
+	if (ftruncate(fd, (off_t)pages * XC_PAGE_SIZE)) {
+		assert(close(fd) == 0);
+		goto fail;
+	}
+	buffer->ptr = mmap(NULL, (size_t)pages * XC_PAGE_SIZE,
+	                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(close(fd) == 0);
+	if (buffer->ptr == MAP_FAILED)
+		goto fail;
+
+	buffer->refcount = 1;
+	buffer->alloc = qalloc;
+	buffer->size = bytes;
+	buffer->pages = pages;
+	buffer->format = format->format;
+	buffer->qubes.type = 0; /* WINDOW_DUMP_TYPE_GRANT_REFS */
+	buffer->qubes.width = (uint32_t)width;
+	buffer->qubes.height = (uint32_t)height;
+	buffer->qubes.bpp = 24;
+	qalloc->allocations++;
+	qalloc->buffers++;
+	qalloc->pages += pages;
+	wlr_buffer_init(&buffer->inner, &qubes_bench_buffer_impl, width, height);
+	return &buffer->inner;
+fail:
+	free(buffer);
+	return NULL;
+}
+
+void qubes_buffer_destroy(struct wlr_buffer *raw_buffer)
+{
+	assert(raw_buffer->impl == qubes_buffer_impl_addr);
+	struct qubes_buffer *buffer = wl_container_of(raw_buffer, buffer, inner);
+	if (buffer->refcount > 1) {
+		buffer->refcount--;
+		return;
+	}
+	assert(buffer->refcount == 1);
+	assert(munmap(buffer->ptr, (size_t)buffer->pages * XC_PAGE_SIZE) == 0);
+	buffer->alloc->buffers--;
+	buffer->alloc->pages -= buffer->pages;
+	free(buffer);
+}
+
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,41 @@
+// Command line parsing shared by the benchmarks
+
+#include "common.h"
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+uint32_t qubes_bench_parse_prefix(const char *str, char **end,
+                                  const char *what)
+{
+	errno = 0;
+	unsigned long const value = strtoul(str, end, 10);
+	if (errno || *end == str || value > UINT32_MAX)
+		errx(1, "'%s' is not a valid %s", str, what);
+	return (uint32_t)value;
+}
+
+uint32_t qubes_bench_parse_count(const char *str, const char *what)
+{
+	char *end;
+	uint32_t const value = qubes_bench_parse_prefix(str, &end, what);
+	if (*end)
+		errx(1, "'%s' is not a valid %s", str, what);
+	return value;
+}
+
+void qubes_bench_parse_size(const char *str, const char *what,
+                            uint32_t *width, uint32_t *height)
+{
+	char trailing;
+	if (sscanf(str, "%" SCNu32 "x%" SCNu32 "%c", width, height, &trailing) !=
+	       2 ||
+	    *width < 1 || *height < 1)
+		errx(1, "'%s' is not a valid %s", str, what);
+}
+
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,146 @@
+// Fake of the Rust vchan code, for benchmarking
+
+#include "common.h"
+#include <stdlib.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <qubes-gui-protocol.h>
+
+#include "bench.h"
+#include "main.h"
+#include "qubes_backend.h"
+#include "qubes_output.h"
+
+/*
+ * Messages are not encoded or sent anywhere.  They are only counted, and the
+ * window of each MSG_WINDOW_DUMP is remembered so that it can be acknowledged
+ * in order later.
+ */
+struct qubes_rust_backend {
+	struct qubes_bench_vchan_stats stats;
+	int fd; /* never readable */
+	uint32_t next_id;
+	uint32_t *dumps; /* windows of unacknowledged dumps, oldest first */
+	size_t n_dumps, dumps_capacity;
+};
+
+void *qubes_rust_backend_create(uint16_t domid __attribute__((unused)))
+{
+	struct qubes_rust_backend *backend = calloc(sizeof(*backend), 1);
+	if (!backend)
+		return NULL;
+	if ((backend->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		free(backend);
+		return NULL;
+	}
+	return backend;
+}
+
+void qubes_rust_backend_free(void *ptr)
+{
+	struct qubes_rust_backend *backend = ptr;
+	if (!backend)
+		return;
+	assert(close(backend->fd) == 0);
+	free(backend->dumps);
+	free(backend);
+}
+
+void qubes_rust_backend_set_flush_callback(
+   struct qubes_rust_backend *backend __attribute__((unused)),
+   bool (*callback)(void *) __attribute__((unused)),
+   void *userdata __attribute__((unused)))
+{
+	/* Nothing is ever batched */
+}
+
+int qubes_rust_backend_fd(struct qubes_rust_backend *backend)
+{
+	return backend->fd;
+}
+
+void qubes_rust_flush(struct qubes_rust_backend *backend
+                      __attribute__((unused)))
+{}
+
+uint64_t qubes_rust_coalesced_motion_events(struct qubes_rust_backend *backend
+                                            __attribute__((unused)))
+{
+	return 0;
+}
+
+void qubes_rust_backend_on_fd_ready(struct qubes_rust_backend *backend
+                                    __attribute__((unused)),
+                                    bool is_readable __attribute__((unused)),
+                                    qubes_parse_event_callback callback
+                                    __attribute__((unused)),
+                                    void *userdata __attribute__((unused)))
+{}
+
+bool qubes_rust_reconnect(struct qubes_rust_backend *backend
+                          __attribute__((unused)))
+{
+	return true;
+}
+
+uint32_t qubes_rust_generate_id(void *raw_backend,
+                                void *data __attribute__((unused)))
+{
+	struct qubes_rust_backend *backend = raw_backend;
+	return ++backend->next_id;
+}
+
+void qubes_rust_delete_id(void *backend __attribute__((unused)),
+                          uint32_t id __attribute__((unused)))
+{}
+
+void qubes_rust_send_message(void *raw_backend, struct msg_hdr *header)
+{
+	struct qubes_rust_backend *backend = raw_backend;
+	backend->stats.messages++;
+	backend->stats.bytes += sizeof(*header) + header->untrusted_len;
+	if (header->type != MSG_WINDOW_DUMP)
+		return;
+	backend->stats.dumps++;
+	if (backend->n_dumps == backend->dumps_capacity) {
+		size_t const capacity =
+		   backend->dumps_capacity ? backend->dumps_capacity * 2 : 64;
+		uint32_t *dumps = realloc(backend->dumps, capacity * sizeof(*dumps));
+		assert(dumps && "out of memory");
+		backend->dumps = dumps;
+		backend->dumps_capacity = capacity;
+	}
+	backend->dumps[backend->n_dumps++] = header->window;
+}
+
+void qubes_rust_send_bulk(void *raw_backend, struct msg_hdr *header)
+{
+	qubes_rust_send_message(raw_backend, header);
+	/* Ownership was handed over with the message */
+	free(header);
+}
+
+void qubes_bench_vchan_stats(struct qubes_rust_backend *backend,
+                             struct qubes_bench_vchan_stats *stats)
+{
+	*stats = backend->stats;
+}
+
+void qubes_bench_vchan_ack_dumps(struct qubes_rust_backend *backend,
+                                 struct tinywl_server *server)
+{
+	/* Acknowledging a dump can send a held one, so do not iterate in place */
+	while (backend->n_dumps) {
+		size_t const n_dumps = backend->n_dumps;
+		uint32_t *dumps = backend->dumps;
+		backend->dumps = NULL;
+		backend->n_dumps = backend->dumps_capacity = 0;
+		for (size_t i = 0; i < n_dumps; ++i)
+			qubes_output_dump_acked(server, dumps[i]);
+		free(dumps);
+	}
+}
+
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,238 @@
+// Synthetic clients and the server they use, shared by the benchmarks
+
+#include "common.h"
+#include <err.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <wlr/interfaces/wlr_buffer.h>
+#include <wlr/render/pixman.h>
+#include <wlr/render/wlr_renderer.h>
+#include <wlr/types/wlr_buffer.h>
+#include <wlr/types/wlr_scene.h>
+
+#include <drm_fourcc.h>
+
+#include "bench.h"
+#include "main.h"
+#include "qubes_allocator.h"
+#include "qubes_backend.h"
+#include "qubes_output.h"
+
+/* A buffer a client drew into with wl_shm */
+struct qubes_bench_client_buffer {
+	struct wlr_buffer inner;
+	uint32_t *pixels;
+};
+
+uint64_t qubes_bench_now_ns(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void qubes_bench_buffer_destroy(struct wlr_buffer *raw_buffer)
+{
+	struct qubes_bench_client_buffer *buffer =
+	   wl_container_of(raw_buffer, buffer, inner);
+	free(buffer->pixels);
+	free(buffer);
+}
+
+static bool qubes_bench_buffer_begin_data_ptr_access(
+   struct wlr_buffer *raw_buffer, uint32_t flags, void **data,
+   uint32_t *format, size_t *stride)
+{
+	struct qubes_bench_client_buffer *buffer =
+	   wl_container_of(raw_buffer, buffer, inner);
+	if (flags & (uint32_t)WLR_BUFFER_DATA_PTR_ACCESS_WRITE)
+		return false;
+	if (data)
+		*data = buffer->pixels;
+	if (format)
+		*format = DRM_FORMAT_XRGB8888;
+	if (stride)
+		*stride = (size_t)raw_buffer->width * sizeof(uint32_t);
+	return true;
+}
+
+static void qubes_bench_buffer_end_data_ptr_access(struct wlr_buffer *buffer
+                                                   __attribute__((unused)))
+{}
+
+static const struct wlr_buffer_impl qubes_bench_client_buffer_impl = {
+	.destroy = qubes_bench_buffer_destroy,
+	.begin_data_ptr_access = qubes_bench_buffer_begin_data_ptr_access,
+	.end_data_ptr_access = qubes_bench_buffer_end_data_ptr_access,
+};
+
+static struct wlr_buffer *qubes_bench_client_buffer_create(uint32_t width,
+                                                           uint32_t height)
+{
+	struct qubes_bench_client_buffer *buffer = calloc(sizeof(*buffer), 1);
+	if (!buffer)
+		return NULL;
+	if (!(buffer->pixels =
+	         calloc((size_t)width * height, sizeof(*buffer->pixels)))) {
+		free(buffer);
+		return NULL;
+	}
+	wlr_buffer_init(&buffer->inner, &qubes_bench_client_buffer_impl,
+	                (int)width, (int)height);
+	return &buffer->inner;
+}
+
+struct tinywl_server *qubes_bench_server_create(void)
+{
+	struct tinywl_server *server = calloc(1, sizeof(*server));
+	if (!server)
+		err(1, "calloc");
+	server->magic = QUBES_SERVER_MAGIC;
+	server->listening_socket = -1;
+	server->diff.pixel_budget = 1 << 22;
+	server->stable_buffer_bytes = 4 << 20;
+	wl_list_init(&server->views);
+	wl_list_init(&server->spare_outputs);
+	wl_list_init(&server->outputs);
+	wl_list_init(&server->keyboards);
+	if (!(server->wl_display = wl_display_create()))
+		errx(1, "Cannot create wl_display");
+	if (!(server->allocator = qubes_allocator_create(0)))
+		errx(1, "Cannot create allocator");
+	if (!(server->renderer = wlr_pixman_renderer_create()))
+		errx(1, "Cannot create Pixman renderer");
+	if (!(server->backend =
+	         qubes_backend_create(server->wl_display, 0, &server->views)))
+		errx(1, "Cannot create backend");
+	server->backend->server = server;
+	/* A daemon that acknowledges dumps, so the dump ring is exercised */
+	server->backend->protocol_version = 0x10007;
+	server->backend->connected = true;
+	return server;
+}
+
+void qubes_bench_server_destroy(struct tinywl_server *server)
+{
+	qubes_output_free_spares(server);
+	qubes_dump_ring_release(&server->dumps);
+	free(server->dumps.dumps);
+	wl_display_destroy(server->wl_display);
+	wlr_renderer_destroy(server->renderer);
+	wlr_allocator_destroy(server->allocator);
+	free(server);
+}
+
+struct qubes_bench_window *
+qubes_bench_window_create(struct tinywl_server *server, struct wlr_box box,
+                          bool override_redirect, bool composite)
+{
+	/* Override-redirect windows may get a spare output, as popups do */
+	QUBES_STATIC_ASSERT(offsetof(struct qubes_bench_window, output) == 0);
+	struct qubes_bench_window *window = qubes_output_alloc_view(
+	   server, QUBES_VIEW_MAGIC, sizeof(*window), override_redirect);
+	if (!window)
+		return NULL;
+	if (!(window->buffer = qubes_bench_client_buffer_create(
+	         (uint32_t)box.width, (uint32_t)box.height)))
+		errx(1, "Cannot create client buffer");
+	if (!qubes_output_init(&window->output, server, override_redirect, NULL,
+	                       QUBES_VIEW_MAGIC, box.x, box.y, (uint32_t)box.width,
+	                       (uint32_t)box.height) ||
+	    !qubes_output_configure(&window->output, box))
+		errx(1, "Cannot create window");
+	/* There is no surface to map, so only the flag is set */
+	window->output.flags |= QUBES_OUTPUT_MAPPED;
+	/* Stands in for the subsurface tree of a real surface */
+	struct wlr_scene_tree *tree;
+	if (!(tree = wlr_scene_tree_create(&window->output.scene->tree)) ||
+	    !(window->scene_buffer = wlr_scene_buffer_create(tree, window->buffer)))
+		errx(1, "Cannot create scene buffer");
+	window->output.scene_subsurface_tree = tree;
+	if (composite) {
+		static const float red[4] = { 1, 0, 0, 1 };
+		if (!(window->overlay = wlr_scene_rect_create(
+		         &window->output.scene->tree, 16, 16, red)))
+			errx(1, "Cannot create overlay");
+	}
+	return window;
+}
+
+void qubes_bench_window_destroy(struct qubes_bench_window *window)
+{
+	/* A parked output must have nothing in its scene but the surface */
+	if (window->overlay)
+		wlr_scene_node_destroy(&window->overlay->node);
+	/* Freed when the subsurface tree is destroyed */
+	wlr_buffer_drop(window->buffer);
+	if (qubes_output_park(&window->output, sizeof(*window)))
+		return;
+	qubes_output_deinit(&window->output);
+	free(window);
+}
+
+uint64_t qubes_bench_window_frame(struct qubes_bench_window *window,
+                                  uint32_t damage_width,
+                                  uint32_t damage_height, uint32_t frame)
+{
+	struct qubes_bench_client_buffer *buffer =
+	   wl_container_of(window->buffer, buffer, inner);
+	uint32_t const width = (uint32_t)window->buffer->width;
+	uint32_t const height = (uint32_t)window->buffer->height;
+	uint32_t const dw = QUBES_MIN(damage_width, width);
+	uint32_t const dh = QUBES_MIN(damage_height, height);
+	uint32_t const x = (frame * 64) % (width - dw + 1);
+	uint32_t const y = (frame * 16) % (height - dh + 1);
+	for (uint32_t row = y; row < y + dh; ++row) {
+		uint32_t *const line = buffer->pixels + (size_t)row * width;
+		for (uint32_t col = x; col < x + dw; ++col)
+			line[col] = qubes_bench_frame_pixel(frame) + row * 7 + col;
+	}
+	pixman_region32_t damage;
+	pixman_region32_init_rect(&damage, (int)x, (int)y, dw, dh);
+	wlr_scene_buffer_set_buffer_with_damage(window->scene_buffer,
+	                                        window->buffer, &damage);
+	pixman_region32_fini(&damage);
+
+	uint64_t const start = qubes_bench_now_ns();
+	wlr_output_send_frame(&window->output.output);
+	return qubes_bench_now_ns() - start;
+}
+
+uint32_t qubes_bench_frame_pixel(uint32_t frame)
+{
+	return frame * 0x010203;
+}
+
+uint32_t qubes_bench_window_sent_pixel(struct qubes_bench_window *window)
+{
+	struct wlr_buffer *raw_buffer = window->output.buffer;
+	if (!raw_buffer)
+		return 0;
+	assert(raw_buffer->impl == qubes_buffer_impl_addr);
+	struct qubes_buffer *buffer = wl_container_of(raw_buffer, buffer, inner);
+	return *(const uint32_t *)buffer->ptr;
+}
+
+void qubes_bench_window_resize(struct qubes_bench_window *window,
+                               uint32_t width, uint32_t height)
+{
+	struct wlr_buffer *buffer = qubes_bench_client_buffer_create(width, height);
+	if (!buffer)
+		errx(1, "Cannot create client buffer");
+	/* The scene holds the old buffer until this replaces it */
+	wlr_scene_buffer_set_buffer(window->scene_buffer, buffer);
+	wlr_buffer_drop(window->buffer);
+	window->buffer = buffer;
+	struct wlr_box const box = {
+		.x = window->output.guest.x,
+		.y = window->output.guest.y,
+		.width = (int)width,
+		.height = (int)height,
+	};
+	if (!qubes_output_configure(&window->output, box))
+		errx(1, "Cannot resize window");
+}
+
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,266 @@
+// Benchmark of the frame path, from a client commit to the vchan
+
+#include "common.h"
+#include <err.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wayland-server-core.h>
+
+#include <wlr/render/allocator.h>
+#include <wlr/types/wlr_buffer.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_scene.h>
+#include <wlr/util/log.h>
+
+#include "bench.h"
+#include "main.h"
+#include "qubes_allocator.h"
+#include "qubes_backend.h"
+#include "qubes_output.h"
+
+/*
+ * Each synthetic client (see bench.h) draws and commits a frame in turn.  In
+ * "scanout" mode the client buffer is the only thing visible, so it is copied
+ * into a grant buffer.  In "composite" mode a small rectangle on top forces
+ * the scene to be rendered with pixman.
+ *
+ * Results are printed as one JSON object per line.
+ */
+
+struct qubes_bench_options {
+	uint32_t windows, frames, warmup;
+	uint32_t width, height;
+	uint32_t damage_width, damage_height;
+	size_t diff_memory;
+	size_t stable_buffer_bytes;
+};
+
+struct qubes_bench_result {
+	uint64_t commits, commit_ns, max_commit_ns, wall_ns;
+	uint64_t messages, bytes, dumps, allocations;
+	uint64_t damage_pixels; /* sent with MSG_SHMIMAGE */
+};
+
+static void qubes_bench_run(struct tinywl_server *server,
+                            const struct qubes_bench_options *options,
+                            bool composite, struct qubes_bench_result *result)
+{
+	struct qubes_rust_backend *const vchan = server->backend->rust_backend;
+	struct qubes_bench_window **windows =
+	   calloc(options->windows, sizeof(*windows));
+	if (!windows)
+		err(1, "calloc");
+	for (uint32_t i = 0; i < options->windows; ++i) {
+		struct wlr_box const box = {
+			.x = (int)(i * 16),
+			.y = (int)(i * 16),
+			.width = (int)options->width,
+			.height = (int)options->height,
+		};
+		if (!(windows[i] =
+		         qubes_bench_window_create(server, box, false, composite)))
+			err(1, "Cannot create window");
+	}
+
+	/* Let swapchains and the dump ring reach their steady state */
+	for (uint32_t frame = 0; frame < options->warmup; ++frame) {
+		for (uint32_t i = 0; i < options->windows; ++i)
+			qubes_bench_window_frame(windows[i], options->damage_width,
+			                         options->damage_height, frame);
+		qubes_bench_vchan_ack_dumps(vchan, server);
+	}
+
+	struct qubes_bench_vchan_stats before, after;
+	qubes_bench_vchan_stats(vchan, &before);
+	uint64_t const allocations = qubes_bench_allocations(server->allocator);
+	memset(result, 0, sizeof(*result));
+	for (uint32_t i = 0; i < options->windows; ++i)
+		result->damage_pixels -= windows[i]->output.stats.damage_pixels;
+	uint64_t const start = qubes_bench_now_ns();
+	for (uint32_t frame = 0; frame < options->frames; ++frame) {
+		for (uint32_t i = 0; i < options->windows; ++i) {
+			uint64_t const ns = qubes_bench_window_frame(
+			   windows[i], options->damage_width, options->damage_height,
+			   options->warmup + frame);
+			result->commits++;
+			result->commit_ns += ns;
+			result->max_commit_ns = QUBES_MAX(result->max_commit_ns, ns);
+		}
+		qubes_bench_vchan_ack_dumps(vchan, server);
+	}
+	result->wall_ns = qubes_bench_now_ns() - start;
+	qubes_bench_vchan_stats(vchan, &after);
+	result->messages = after.messages - before.messages;
+	result->bytes = after.bytes - before.bytes;
+	result->dumps = after.dumps - before.dumps;
+	result->allocations =
+	   qubes_bench_allocations(server->allocator) - allocations;
+	for (uint32_t i = 0; i < options->windows; ++i)
+		result->damage_pixels += windows[i]->output.stats.damage_pixels;
+
+	for (uint32_t i = 0; i < options->windows; ++i)
+		qubes_bench_window_destroy(windows[i]);
+	free(windows);
+	qubes_bench_vchan_ack_dumps(vchan, server);
+}
+
+static void qubes_bench_report(const char *mode,
+                               const struct qubes_bench_options *options,
+                               const struct qubes_bench_result *result)
+{
+	double const frames = result->commits ? (double)result->commits : 1;
+	printf("{\"benchmark\":\"hot-path\",\"mode\":\"%s\",\"windows\":%" PRIu32
+	       ",\"width\":%" PRIu32 ",\"height\":%" PRIu32
+	       ",\"damage_width\":%" PRIu32 ",\"damage_height\":%" PRIu32
+	       ",\"diff_memory\":%zu,\"stable_buffer_size\":%zu"
+	       ",\"frames\":%" PRIu64
+	       ",\"frames_per_sec\":%.1f,\"us_per_commit\":%.3f"
+	       ",\"max_us_per_commit\":%.3f,\"messages_per_frame\":%.3f"
+	       ",\"bytes_per_frame\":%.1f,\"dumps_per_frame\":%.3f"
+	       ",\"allocations_per_frame\":%.3f"
+	       ",\"damage_pixels_per_frame\":%.1f}\n",
+	       mode, options->windows, options->width, options->height,
+	       options->damage_width, options->damage_height, options->diff_memory,
+	       options->stable_buffer_bytes, result->commits,
+	       result->wall_ns ? frames * 1e9 / (double)result->wall_ns : 0,
+	       (double)result->commit_ns / frames / 1000,
+	       (double)result->max_commit_ns / 1000,
+	       (double)result->messages / frames, (double)result->bytes / frames,
+	       (double)result->dumps / frames, (double)result->allocations / frames,
+	       (double)result->damage_pixels / frames);
+	if (fflush(stdout))
+		err(1, "Cannot write results");
+}
+
+static _Noreturn void usage(const char *name, int status)
+{
+	fprintf(status ? stderr : stdout,
+	        "Usage: %s [options]\n"
+	        "\n"
+	        "Options:\n"
+	        "\n"
+	        " -m, --mode [scanout|composite|both]:\n"
+	        "   Which frame path to measure.  The default is both.\n"
+	        " -w, --windows count:\n"
+	        "   Number of synthetic clients.  The default is 4.\n"
+	        " -f, --frames count:\n"
+	        "   Frames measured per client.  The default is 600.\n"
+	        " -u, --warmup count:\n"
+	        "   Frames drawn per client before measuring.  The default is 60.\n"
+	        " -s, --size WIDTHxHEIGHT:\n"
+	        "   Window size.  The default is 1280x720.\n"
+	        " -d, --damage WIDTHxHEIGHT:\n"
+	        "   Size of the area changed by each frame.  The default is\n"
+	        "   256x256.\n"
+	        " -D, --damage-diff-memory MiB:\n"
+	        "   As for qubes-compositor.  The default, 0, disables diffing.\n"
+	        " -S, --stable-buffer-size MiB:\n"
+	        "   As for qubes-compositor.  The default is 4.\n"
+	        "\n"
+	        "Each mode prints one line of JSON.\n",
+	        name);
+	exit(status);
+}
+
+int main(int argc, char *argv[])
+{
+	struct qubes_bench_options options = {
+		.windows = 4,
+		.frames = 600,
+		.warmup = 60,
+		.width = 1280,
+		.height = 720,
+		.damage_width = 256,
+		.damage_height = 256,
+		.stable_buffer_bytes = 4 << 20,
+	};
+	bool scanout = true, composite = true;
+	struct option long_options[] = {
+		{ "mode", required_argument, 0, 'm' },
+		{ "windows", required_argument, 0, 'w' },
+		{ "frames", required_argument, 0, 'f' },
+		{ "warmup", required_argument, 0, 'u' },
+		{ "size", required_argument, 0, 's' },
+		{ "damage", required_argument, 0, 'd' },
+		{ "damage-diff-memory", required_argument, 0, 'D' },
+		{ "stable-buffer-size", required_argument, 0, 'S' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 },
+	};
+	int c;
+	while ((c = getopt_long(argc, argv, "m:w:f:u:s:d:D:S:h", long_options,
+	                        NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			scanout = !strcmp(optarg, "scanout") || !strcmp(optarg, "both");
+			composite = !strcmp(optarg, "composite") || !strcmp(optarg, "both");
+			if (!scanout && !composite)
+				usage(argv[0], 1);
+			break;
+		case 'w':
+			options.windows = qubes_bench_parse_count(optarg, "window count");
+			break;
+		case 'f':
+			options.frames = qubes_bench_parse_count(optarg, "frame count");
+			break;
+		case 'u':
+			options.warmup = qubes_bench_parse_count(optarg, "frame count");
+			break;
+		case 's':
+			qubes_bench_parse_size(optarg, "window size", &options.width,
+			                       &options.height);
+			if (options.width > MAX_WINDOW_WIDTH ||
+			    options.height > MAX_WINDOW_HEIGHT)
+				errx(1, "Window size %s is too large", optarg);
+			break;
+		case 'd':
+			qubes_bench_parse_size(optarg, "damage size", &options.damage_width,
+			                       &options.damage_height);
+			break;
+		case 'D':
+			options.diff_memory =
+			   (size_t)qubes_bench_parse_count(optarg, "memory size") << 20;
+			break;
+		case 'S':
+			options.stable_buffer_bytes =
+			   (size_t)qubes_bench_parse_count(optarg, "buffer size") << 20;
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], 1);
+		}
+	}
+	if (optind != argc || options.windows < 1)
+		usage(argv[0], 1);
+
+	wlr_log_init(WLR_ERROR, NULL);
+	struct tinywl_server *server = qubes_bench_server_create();
+	server->diff.shadow_limit = options.diff_memory;
+	server->stable_buffer_bytes = options.stable_buffer_bytes;
+
+	struct qubes_bench_result result;
+	if (scanout) {
+		qubes_bench_run(server, &options, false, &result);
+		qubes_bench_report("scanout", &options, &result);
+		/* Scanout must send the damage, not the whole window */
+		if ((uint64_t)options.damage_width * options.damage_height <
+		       (uint64_t)options.width * options.height &&
+		    result.damage_pixels >=
+		       result.commits * options.width * options.height)
+			errx(1, "Scanout frames sent the whole window");
+	}
+	if (composite) {
+		qubes_bench_run(server, &options, true, &result);
+		qubes_bench_report("composite", &options, &result);
+	}
+
+	qubes_bench_server_destroy(server);
+	return 0;
+}
+
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
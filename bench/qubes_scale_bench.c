@@ -0,0 +1,348 @@
+// Benchmark of how the compositor scales with the number of windows
+
+#include "common.h"
+#include <err.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wayland-server-core.h>
+
+#include <wlr/util/log.h>
+
+#include "bench.h"
+#include "main.h"
+#include "qubes_backend.h"
+#include "qubes_output.h"
+
+/*
+ * Each run creates N synthetic clients (see bench.h) and then runs a number
+ * of ticks.  In each tick a share of the windows commits a frame, a few
+ * windows are resized to a new buffer size, a few override-redirect windows
+ * (popups and menus) are created, drawn and destroyed again, reusing spare
+ * outputs as the compositor does (see qubes_output_park()), the fake
+ * daemon acknowledges every dump, and the event loop runs its timers and
+ * idle sources once, as the real main loop would.  The time of the whole
+ * tick is recorded.
+ *
+ * Memory per window is the growth of the heap and of the grant pages after
+ * every window has drawn its first frame, less the client buffers, which
+ * would live in the clients.  It includes the wlr_output, wlr_scene and
+ * swapchain of each window.
+ *
+ * Results are printed as one JSON object per window count, so that the
+ * growth with N can be plotted.
+ */
+
+struct qubes_scale_options {
+	uint32_t *counts; /* window counts to run with */
+	size_t n_counts;
+	uint32_t ticks, warmup;
+	uint32_t width, height;
+	uint32_t damage_width, damage_height;
+	uint32_t commit_percent; /* windows committing per tick */
+	uint32_t popups;         /* popups created and destroyed per tick */
+	uint32_t resizes;        /* windows resized per tick */
+};
+
+struct qubes_scale_result {
+	uint64_t total_ns, p50_ns, p99_ns, max_ns;
+	uint64_t heap_bytes, grant_pages; /* per window */
+	uint64_t messages, bytes;
+};
+
+enum {
+	QUBES_SCALE_POPUP_WIDTH = 200,
+	QUBES_SCALE_POPUP_HEIGHT = 300,
+};
+
+static uint64_t qubes_scale_heap_bytes(void)
+{
+	struct mallinfo2 const info = mallinfo2();
+	return (uint64_t)info.uordblks + (uint64_t)info.hblkhd;
+}
+
+static int qubes_scale_compare(const void *a, const void *b)
+{
+	uint64_t const x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void qubes_scale_tick(struct tinywl_server *server,
+                             const struct qubes_scale_options *options,
+                             struct qubes_bench_window **windows,
+                             uint32_t n_windows, uint32_t tick)
+{
+	uint32_t const committing = QUBES_MIN(
+	   n_windows, (n_windows * options->commit_percent + 99) / 100);
+	for (uint32_t i = 0; i < committing; ++i) {
+		uint32_t const index =
+		   (uint32_t)(((uint64_t)tick * committing + i) % n_windows);
+		qubes_bench_window_frame(windows[index], options->damage_width,
+		                         options->damage_height, tick);
+	}
+	for (uint32_t i = 0; i < options->resizes; ++i) {
+		uint32_t const index =
+		   (uint32_t)(((uint64_t)tick * options->resizes + i) % n_windows);
+		/* Alternate between two sizes, so buffers cannot be reused as-is */
+		uint32_t const shrink = (tick + i) & 1 ? 32 : 0;
+		uint32_t const width =
+		   options->width > shrink ? options->width - shrink : options->width;
+		uint32_t const height =
+		   options->height > shrink ? options->height - shrink : options->height;
+		qubes_bench_window_resize(windows[index], width, height);
+		qubes_bench_window_frame(windows[index], options->damage_width,
+		                         options->damage_height, tick);
+	}
+	for (uint32_t i = 0; i < options->popups; ++i) {
+		struct wlr_box const box = {
+			.x = (int)((tick * 37 + i * 11) % options->width),
+			.y = (int)((tick * 13 + i * 7) % options->height),
+			.width = QUBES_SCALE_POPUP_WIDTH,
+			.height = QUBES_SCALE_POPUP_HEIGHT,
+		};
+		struct qubes_bench_window *popup =
+		   qubes_bench_window_create(server, box, true, false);
+		if (!popup)
+			err(1, "Cannot create popup");
+		qubes_bench_window_frame(popup, QUBES_SCALE_POPUP_WIDTH,
+		                         QUBES_SCALE_POPUP_HEIGHT, tick);
+		qubes_bench_window_destroy(popup);
+	}
+	qubes_bench_vchan_ack_dumps(server->backend->rust_backend, server);
+	wl_event_loop_dispatch(wl_display_get_event_loop(server->wl_display), 0);
+}
+
+static void qubes_scale_run(struct tinywl_server *server,
+                            const struct qubes_scale_options *options,
+                            uint32_t n_windows,
+                            struct qubes_scale_result *result)
+{
+	struct qubes_rust_backend *const vchan = server->backend->rust_backend;
+	struct qubes_bench_window **windows = calloc(n_windows, sizeof(*windows));
+	uint64_t *tick_ns = calloc(QUBES_MAX(options->ticks, 1U), sizeof(*tick_ns));
+	if (!windows || !tick_ns)
+		err(1, "calloc");
+	memset(result, 0, sizeof(*result));
+
+	uint64_t const heap = qubes_scale_heap_bytes();
+	uint64_t const pages = qubes_bench_allocated_pages(server->allocator);
+	for (uint32_t i = 0; i < n_windows; ++i) {
+		struct wlr_box const box = {
+			.x = (int)(i % 64 * 16),
+			.y = (int)(i % 64 * 16),
+			.width = (int)options->width,
+			.height = (int)options->height,
+		};
+		if (!(windows[i] = qubes_bench_window_create(server, box, false, false)))
+			err(1, "Cannot create window");
+		qubes_bench_window_frame(windows[i], options->width, options->height,
+		                         0);
+	}
+	qubes_bench_vchan_ack_dumps(vchan, server);
+	uint64_t const client_bytes =
+	   (uint64_t)options->width * options->height * sizeof(uint32_t);
+	uint64_t const heap_growth = qubes_scale_heap_bytes() - heap;
+	result->heap_bytes =
+	   heap_growth / n_windows - QUBES_MIN(heap_growth / n_windows, client_bytes);
+	result->grant_pages =
+	   (qubes_bench_allocated_pages(server->allocator) - pages) / n_windows;
+
+	for (uint32_t tick = 0; tick < options->warmup; ++tick)
+		qubes_scale_tick(server, options, windows, n_windows, tick);
+
+	struct qubes_bench_vchan_stats before, after;
+	qubes_bench_vchan_stats(vchan, &before);
+	for (uint32_t tick = 0; tick < options->ticks; ++tick) {
+		uint64_t const start = qubes_bench_now_ns();
+		qubes_scale_tick(server, options, windows, n_windows,
+		                 options->warmup + tick);
+		tick_ns[tick] = qubes_bench_now_ns() - start;
+		result->total_ns += tick_ns[tick];
+	}
+	qubes_bench_vchan_stats(vchan, &after);
+	result->messages = after.messages - before.messages;
+	result->bytes = after.bytes - before.bytes;
+	if (options->ticks) {
+		qsort(tick_ns, options->ticks, sizeof(*tick_ns), qubes_scale_compare);
+		result->p50_ns = tick_ns[options->ticks / 2];
+		result->p99_ns = tick_ns[(uint64_t)options->ticks * 99 / 100];
+		result->max_ns = tick_ns[options->ticks - 1];
+	}
+
+	for (uint32_t i = 0; i < n_windows; ++i)
+		qubes_bench_window_destroy(windows[i]);
+	free(windows);
+	free(tick_ns);
+	qubes_bench_vchan_ack_dumps(vchan, server);
+}
+
+static void qubes_scale_report(const struct qubes_scale_options *options,
+                               uint32_t n_windows,
+                               const struct qubes_scale_result *result)
+{
+	double const ticks = options->ticks ? (double)options->ticks : 1;
+	printf("{\"benchmark\":\"scale\",\"windows\":%" PRIu32
+	       ",\"width\":%" PRIu32 ",\"height\":%" PRIu32
+	       ",\"damage_width\":%" PRIu32 ",\"damage_height\":%" PRIu32
+	       ",\"commit_percent\":%" PRIu32 ",\"popups\":%" PRIu32
+	       ",\"resizes\":%" PRIu32 ",\"ticks\":%" PRIu32
+	       ",\"us_per_tick\":%.3f,\"p50_us_per_tick\":%.3f"
+	       ",\"p99_us_per_tick\":%.3f,\"max_us_per_tick\":%.3f"
+	       ",\"heap_bytes_per_window\":%" PRIu64
+	       ",\"grant_pages_per_window\":%" PRIu64
+	       ",\"messages_per_tick\":%.3f,\"bytes_per_tick\":%.1f}\n",
+	       n_windows, options->width, options->height, options->damage_width,
+	       options->damage_height, options->commit_percent, options->popups,
+	       options->resizes, options->ticks,
+	       (double)result->total_ns / ticks / 1000,
+	       (double)result->p50_ns / 1000, (double)result->p99_ns / 1000,
+	       (double)result->max_ns / 1000, result->heap_bytes,
+	       result->grant_pages, (double)result->messages / ticks,
+	       (double)result->bytes / ticks);
+	if (fflush(stdout))
+		err(1, "Cannot write results");
+}
+
+static _Noreturn void usage(const char *name, int status)
+{
+	fprintf(status ? stderr : stdout,
+	        "Usage: %s [options]\n"
+	        "\n"
+	        "Options:\n"
+	        "\n"
+	        " -w, --windows count[,count...]:\n"
+	        "   Numbers of synthetic clients to run with, one after the other.\n"
+	        "   The default is 1,10,30,60,100.\n"
+	        " -t, --ticks count:\n"
+	        "   Main loop iterations measured per run.  The default is 300.\n"
+	        " -u, --warmup count:\n"
+	        "   Iterations run before measuring.  The default is 30.\n"
+	        " -s, --size WIDTHxHEIGHT:\n"
+	        "   Window size.  The default is 640x480.\n"
+	        " -d, --damage WIDTHxHEIGHT:\n"
+	        "   Size of the area changed by each frame.  The default is 64x64.\n"
+	        " -r, --commit-rate percent:\n"
+	        "   Share of the windows that commit a frame in each iteration.\n"
+	        "   The default is 20.\n"
+	        " -p, --popups count:\n"
+	        "   Popups created, drawn and destroyed in each iteration.  The\n"
+	        "   default is 1.\n"
+	        " -R, --resizes count:\n"
+	        "   Windows resized in each iteration.  The default is 1.\n"
+	        "\n"
+	        "Each window count prints one line of JSON.\n",
+	        name);
+	exit(status);
+}
+
+static void qubes_scale_parse_counts(const char *str,
+                                     struct qubes_scale_options *options)
+{
+	free(options->counts);
+	options->counts = NULL;
+	options->n_counts = 0;
+	for (const char *p = str;;) {
+		char *end;
+		uint32_t const count = qubes_bench_parse_prefix(p, &end, "window count");
+		if (count < 1 || (*end && *end != ','))
+			errx(1, "'%s' is not a valid list of window counts", str);
+		uint32_t *counts = realloc(options->counts, (options->n_counts + 1) *
+		                                               sizeof(*counts));
+		if (!counts)
+			err(1, "realloc");
+		options->counts = counts;
+		options->counts[options->n_counts++] = count;
+		if (!*end)
+			break;
+		p = end + 1;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct qubes_scale_options options = {
+		.ticks = 300,
+		.warmup = 30,
+		.width = 640,
+		.height = 480,
+		.damage_width = 64,
+		.damage_height = 64,
+		.commit_percent = 20,
+		.popups = 1,
+		.resizes = 1,
+	};
+	qubes_scale_parse_counts("1,10,30,60,100", &options);
+	struct option long_options[] = {
+		{ "windows", required_argument, 0, 'w' },
+		{ "ticks", required_argument, 0, 't' },
+		{ "warmup", required_argument, 0, 'u' },
+		{ "size", required_argument, 0, 's' },
+		{ "damage", required_argument, 0, 'd' },
+		{ "commit-rate", required_argument, 0, 'r' },
+		{ "popups", required_argument, 0, 'p' },
+		{ "resizes", required_argument, 0, 'R' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 },
+	};
+	int c;
+	while ((c = getopt_long(argc, argv, "w:t:u:s:d:r:p:R:h", long_options,
+	                        NULL)) != -1) {
+		switch (c) {
+		case 'w':
+			qubes_scale_parse_counts(optarg, &options);
+			break;
+		case 't':
+			options.ticks = qubes_bench_parse_count(optarg, "iteration count");
+			break;
+		case 'u':
+			options.warmup = qubes_bench_parse_count(optarg, "iteration count");
+			break;
+		case 's':
+			qubes_bench_parse_size(optarg, "window size", &options.width,
+			                       &options.height);
+			if (options.width > MAX_WINDOW_WIDTH ||
+			    options.height > MAX_WINDOW_HEIGHT)
+				errx(1, "Window size %s is too large", optarg);
+			break;
+		case 'd':
+			qubes_bench_parse_size(optarg, "damage size", &options.damage_width,
+			                       &options.damage_height);
+			break;
+		case 'r':
+			options.commit_percent =
+			   qubes_bench_parse_count(optarg, "percentage");
+			if (options.commit_percent > 100)
+				errx(1, "'%s' is not a valid percentage", optarg);
+			break;
+		case 'p':
+			options.popups = qubes_bench_parse_count(optarg, "popup count");
+			break;
+		case 'R':
+			options.resizes = qubes_bench_parse_count(optarg, "resize count");
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], 1);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0], 1);
+
+	wlr_log_init(WLR_ERROR, NULL);
+	struct tinywl_server *server = qubes_bench_server_create();
+	for (size_t i = 0; i < options.n_counts; ++i) {
+		struct qubes_scale_result result;
+		qubes_scale_run(server, &options, options.counts[i], &result);
+		qubes_scale_report(&options, options.counts[i], &result);
+	}
+	qubes_bench_server_destroy(server);
+	free(options.counts);
+	return 0;
+}
+
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
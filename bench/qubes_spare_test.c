@@ -0,0 +1,69 @@
+// Test of spare outputs: a popup that reuses the output of an unmapped one
+
+#include "common.h"
+#include <err.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <wlr/types/wlr_scene.h>
+#include <wlr/util/log.h>
+
+#include "bench.h"
+#include "main.h"
+#include "qubes_output.h"
+
+#define QUBES_CHECK(cond)                                                      \
+	do {                                                                        \
+		if (!(cond))                                                             \
+			errx(1, "%s:%d: check failed: %s", __FILE__, __LINE__, #cond);        \
+	} while (0)
+
+/* Draw a frame over the whole popup, and check that the daemon was sent it */
+static void qubes_spare_check_frame(struct tinywl_server *server,
+                                    struct qubes_bench_window *popup,
+                                    uint32_t frame)
+{
+	uint64_t const damage = popup->output.stats.damage_pixels;
+	qubes_bench_window_frame(popup, popup->output.guest.width,
+	                         popup->output.guest.height, frame);
+	qubes_bench_vchan_ack_dumps(server->backend->rust_backend, server);
+	QUBES_CHECK(popup->output.stats.damage_pixels > damage);
+	QUBES_CHECK((qubes_bench_window_sent_pixel(popup) & 0xFFFFFF) ==
+	            (qubes_bench_frame_pixel(frame) & 0xFFFFFF));
+}
+
+int main(void)
+{
+	wlr_log_init(WLR_ERROR, NULL);
+	struct tinywl_server *server = qubes_bench_server_create();
+	struct wlr_box const box = { .x = 10, .y = 20, .width = 200, .height = 100 };
+
+	struct qubes_bench_window *popup =
+	   qubes_bench_window_create(server, box, true, false);
+	QUBES_CHECK(popup && qubes_output_created(&popup->output));
+	qubes_spare_check_frame(server, popup, 1);
+
+	/* What xdg_surface_unmap() does */
+	struct qubes_output *const output = &popup->output;
+	wlr_scene_node_set_enabled(&output->scene->tree.node, false);
+	wlr_scene_node_set_enabled(&output->scene_subsurface_tree->node, false);
+	qubes_output_unmap(output);
+	qubes_bench_window_destroy(popup);
+	QUBES_CHECK(server->n_spare_outputs == 1);
+
+	popup = qubes_bench_window_create(server, box, true, false);
+	QUBES_CHECK(&popup->output == output);
+	QUBES_CHECK(server->n_spare_outputs == 0);
+	QUBES_CHECK(qubes_output_created(&popup->output));
+	QUBES_CHECK(popup->output.visibility == QUBES_OUTPUT_VISIBLE);
+	qubes_spare_check_frame(server, popup, 2);
+
+	/* Parked again, then freed with the server */
+	qubes_bench_window_destroy(popup);
+	QUBES_CHECK(server->n_spare_outputs == 1);
+	qubes_bench_vchan_ack_dumps(server->backend->rust_backend, server);
+	qubes_bench_server_destroy(server);
+	return 0;
+}
+
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -58,6 +58,7 @@
 #include "main.h"
 #include "qubes_allocator.h"
 #include "qubes_backend.h"
+#include "qubes_keymap.h"
 #include "qubes_output.h"
 #include "qubes_wayland.h"
 #include "qubes_xwayland.h"
@@ -68,7 +69,13 @@
  * - MSG_DOCK: involves a D-Bus listener, out of scope for initial
  *             implementation
  * - MSG_MFNDUMP: obsolete
- * - MSG_CURSOR: requires some sort of image recognition
+ * - MSG_CURSOR: requires some sort of image recognition.  The daemon only
+ *               takes a glyph of the X cursor font, never an image, so
+ *               client cursors cannot be forwarded, cached or not.  They
+ *               are not composited into windows either: wl_pointer
+ *               set_cursor requests are ignored and there is no wlr_cursor,
+ *               so pointer motion causes no damage.  The daemon draws its
+ *               own pointer.
  */
 
 // A single *physical* output (in the GUI daemon).
@@ -80,29 +87,6 @@ struct tinywl_output {
 	struct wlr_output *wlr_output;
 };
 
-static void qubes_send_frame_done(struct wlr_scene_buffer *surface,
-                                  int sx __attribute__((unused)),
-                                  int sy __attribute__((unused)), void *data)
-{
-	wlr_scene_buffer_send_frame_done(surface, data);
-}
-
-static int qubes_send_frame_callbacks(void *data)
-{
-	struct tinywl_server *server = data;
-	struct timespec now;
-	struct qubes_output *output;
-	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
-	server->frame_pending = false;
-	wl_list_for_each (output, &server->views, link) {
-		output->output.frame_pending = false;
-		wlr_output_send_frame(&output->output);
-		wlr_scene_node_for_each_buffer(&output->scene_output->scene->tree.node,
-		                               qubes_send_frame_done, &now);
-	}
-	return 0;
-}
-
 static void keyboard_handle_modifiers(struct wl_listener *listener,
                                       void *data __attribute__((unused)))
 {
@@ -301,6 +285,26 @@ static int qubes_clean_exit(int signal_number, void *data)
 	wl_display_terminate(((struct tinywl_server *)data)->wl_display);
 	return 0;
 }
+/*
+ * Log performance counters for every window.  They are not errors, so they
+ * are only visible with --log-level=info or in debug mode.
+ */
+static int qubes_log_stats(int signal_number __attribute__((unused)),
+                           void *data)
+{
+	struct tinywl_server *server = data;
+	struct qubes_output *output;
+	wlr_log(WLR_INFO,
+	        "Statistics: %" PRIu32 " window dumps awaiting ACK, %" PRIu64
+	        " motion events coalesced",
+	        server->dumps.len,
+	        qubes_rust_coalesced_motion_events(server->backend->rust_backend));
+	qubes_allocator_log_stats(server->allocator);
+	wl_list_for_each (output, &server->views, link)
+		qubes_output_log_stats(output);
+	return 0;
+}
+
 volatile sig_atomic_t crashing = 0;
 
 static void sigpipe_handler(int signum, siginfo_t *siginfo, void *ucontext) {}
@@ -342,10 +346,32 @@ static _Noreturn void usage(char *name, int status)
 		"   layout cannot be switched to. \"exit\" means to exit with status\n"
 		"   78. \"continue\" means to continue using the old layout.\n"
 		"   \"continue\" is the default.\n"
+	   " --damage-diff-memory [MiB]:\n"
+	   "   Compare damaged regions with a copy of the previous frame and\n"
+		"   only send the parts that changed.  This pays off for big,\n"
+		"   mostly static windows.  The argument is the largest copy kept\n"
+		"   per window; bigger windows are not compared.  The default, 0,\n"
+		"   disables comparison.\n"
+	   " --damage-diff-budget [pixels]:\n"
+	   "   Compare at most this many pixels per window and frame, and\n"
+		"   send the rest of the damage unchanged.  Windows where most\n"
+		"   compared pixels changed use a smaller budget, and eventually\n"
+		"   stop comparing for a while.  The default is 4194304.\n"
+	   " --stable-buffer-size [MiB]:\n"
+	   "   Windows at least this big are drawn into a copy of one grant\n"
+		"   buffer that the GUI daemon maps only once, and later frames\n"
+		"   only send what changed.  Smaller windows get a new buffer for\n"
+		"   every frame.  The default is 4, and 0 disables the copy.\n"
+	   " --refresh-rate [Hz]:\n"
+	   "   Rate at which windows get frame callbacks, unless the GUI\n"
+		"   daemon is slower to acknowledge frames.  The default is 60.\n"
 	   "\n"
 	   "For boolean option arguments, \"yes\", \"1\", \"enabled\", and \"true\"\n"
 	   "are considered true, \"no\", \"0\", \"disabled\", and \"false\" are\n"
-	   "considered false, and anything else is an error.\n",
+	   "considered false, and anything else is an error.\n"
+	   "\n"
+	   "On SIGUSR1, per-window performance counters are logged at the\n"
+	   "\"info\" log level.\n",
 	   name);
 	if (ferror(stdout) || ferror(stderr) || fflush(NULL))
 		exit(1);
@@ -505,41 +531,43 @@ static int parse_verbosity(const char *optarg)
 	     optarg);
 }
 
+/* Called once the keymap for the current layout is ready */
+static void qubes_keymap_ready(void *data, const char *layout,
+                               struct xkb_keymap *keymap)
+{
+	struct tinywl_server *server = data;
+	if (!keymap) {
+		wlr_log(WLR_ERROR, "Cannot compile XKB keymap for layout %s", layout);
+		if (server->keymap_errors_fatal) {
+			server->exit_status = 78;
+			sd_notifyf(0, "STOPPING=1\nSTATUS=Failed to compile XKB keymap\n");
+			wl_display_terminate(server->wl_display);
+		}
+		return;
+	}
+	wlr_keyboard_set_keymap(server->keyboard.keyboard, keymap);
+	wlr_log(WLR_DEBUG, "Refreshed keyboard layout from qubesdb");
+}
+
 static void qubes_refresh_keyboard_layout(struct tinywl_server *server)
 {
 	wlr_log(WLR_DEBUG, "Refreshing keyboard layout from qubesdb");
-	struct xkb_rule_names names = { 0 };
 	char *keyboard_layout =
 	   qdb_read(server->qubesdb_connection, "/keyboard-layout", NULL);
 	if (keyboard_layout) {
-		names.layout = keyboard_layout;
-		char *end_layout = strchr(keyboard_layout, '+');
-		if (end_layout) {
-			*end_layout++ = 0;
-			names.variant = end_layout;
-			end_layout = strchr(end_layout, '+');
-			if (end_layout) {
-				*end_layout++ = 0;
-				// use NULL for defaults rather than disabling all options
-				if (*end_layout)
-					names.options = end_layout;
-			}
-		}
-		struct xkb_keymap *keymap = xkb_keymap_new_from_names(
-		   server->keyboard.context, &names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+		// The keymap is compiled on another thread, and qubes_keymap_ready()
+		// is called when it is done.
+		bool const ok =
+		   qubes_keymap_compiler_request(server->keymap_compiler, keyboard_layout);
 		free(keyboard_layout);
-		if (!keymap) {
-			wlr_log(WLR_ERROR, "Cannot compile XKB keymap");
+		if (!ok) {
+			wlr_log(WLR_ERROR, "Cannot allocate memory for keymap request");
 			if (server->keymap_errors_fatal) {
 				server->exit_status = 78;
 				sd_notifyf(0, "STOPPING=1\nSTATUS=Failed to compile XKB keymap\n");
 				wl_display_terminate(server->wl_display);
 			}
-			return;
 		}
-		wlr_keyboard_set_keymap(server->keyboard.keyboard, keymap);
-		xkb_keymap_unref(keymap);
-		wlr_log(WLR_DEBUG, "Refreshed keyboard layout from qubesdb");
 	} else if (errno != ENOENT) {
 		wlr_log(WLR_ERROR, "FATAL: cannot obtain new keyboard layout from "
 		                   "qubesdb: errno %m");
@@ -617,8 +645,45 @@ bad:
 	usage(program_invocation_name, 1);
 }
 
+/*
+ * Per-phase startup timings.  Each phase is reported to systemd as it
+ * finishes, and a summary is logged once the compositor is up, so that slow
+ * boots can be attributed without a debugger.
+ */
+struct qubes_startup_timer {
+	uint64_t last_us;
+	uint64_t start_us;
+	size_t len;
+	char summary[512];
+};
+
+static uint64_t qubes_startup_now_us(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void qubes_startup_phase(struct qubes_startup_timer *timer,
+                                const char *phase)
+{
+	uint64_t const now = qubes_startup_now_us();
+	uint64_t const us = now - timer->last_us;
+	timer->last_us = now;
+	int const n = snprintf(timer->summary + timer->len,
+	                       sizeof(timer->summary) - timer->len,
+	                       "%s%s %" PRIu64 ".%03" PRIu64 " ms",
+	                       timer->len ? ", " : "", phase, us / 1000, us % 1000);
+	if (n > 0)
+		timer->len =
+		   QUBES_MIN(timer->len + (size_t)n, sizeof(timer->summary) - 1);
+	sd_notifyf(0, "STATUS=Starting: %s took %" PRIu64 " us\n", phase, us);
+}
+
 int main(int argc, char *argv[])
 {
+	struct qubes_startup_timer startup = { 0 };
+	startup.start_us = startup.last_us = qubes_startup_now_us();
 	const char *startup_cmd = NULL;
 	char *domid_str = NULL;
 	int c, loglevel = WLR_ERROR;
@@ -642,6 +707,9 @@ int main(int argc, char *argv[])
 	bool primary_selection = false;
 	bool override_verbosity = false;
 	bool handle_sigint = true;
+	unsigned long refresh_hz = 60;
+	server->diff.pixel_budget = 1 << 22;
+	server->stable_buffer_bytes = 4 << 20;
 	struct option long_options[] = {
 		{ "startup-cmd", required_argument, 0, 's' },
 		{ "log-level", required_argument, 0, 'v' },
@@ -651,6 +719,10 @@ int main(int argc, char *argv[])
 		{ "primary-selection", required_argument, 0, 'p' },
 		{ "xwayland", required_argument, 0, 'x' },
 		{ "keymap-errors", required_argument, 0, 'k' },
+		{ "damage-diff-memory", required_argument, 0, 'm' },
+		{ "damage-diff-budget", required_argument, 0, 'b' },
+		{ "stable-buffer-size", required_argument, 0, 'F' },
+		{ "refresh-rate", required_argument, 0, 'R' },
 		{ NULL, 0, 0, 0 },
 	};
 	int last_option;
@@ -686,6 +758,23 @@ int main(int argc, char *argv[])
 			else
 				usage(argv[0], 1);
 			break;
+		case 'm':
+			server->diff.shadow_limit =
+			   strict_strtoul(optarg, "shadow memory limit", 4096) << 20;
+			break;
+		case 'b':
+			server->diff.pixel_budget =
+			   strict_strtoul(optarg, "diff budget", UINT32_MAX);
+			break;
+		case 'F':
+			server->stable_buffer_bytes =
+			   strict_strtoul(optarg, "stable buffer size", 4096) << 20;
+			break;
+		case 'R':
+			refresh_hz = strict_strtoul(optarg, "refresh rate", 1000);
+			if (refresh_hz < 1)
+				usage(argv[0], 1);
+			break;
 		default:
 			warn("Unknown option %s", argv[last_option]);
 			usage(argv[0], 1);
@@ -696,9 +785,11 @@ int main(int argc, char *argv[])
 
 	// Raise the grant table limit
 	raise_grant_limit();
+	qubes_startup_phase(&startup, "grant limit");
 
 	// Drop root privileges
 	drop_privileges();
+	qubes_startup_phase(&startup, "privileges");
 
 	qdb_handle_t qdb = qdb_open(NULL);
 	if (!qdb)
@@ -725,9 +816,11 @@ int main(int argc, char *argv[])
 	server->domid = domid;
 	server->listening_socket = -1;
 	server->qubesdb_connection = qdb;
+	qubes_startup_phase(&startup, "qubesdb");
 
 	if (!(server->allocator = qubes_allocator_create(domid)))
 		err(1, "Cannot create Qubes OS allocator");
+	qubes_startup_phase(&startup, "allocator");
 
 	// Check that the process is single threaded before using much from wlroots
 	check_single_threaded();
@@ -741,16 +834,33 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	/* The backend is a wlroots feature which abstracts the underlying input and
-	 * output hardware. The autocreate option will choose the most suitable
-	 * backend based on the current environment, such as opening an X11 window
-	 * if an X11 server is running. */
-	if (!(server->backend =
-	         qubes_backend_create(server->wl_display, domid, &server->views))) {
-		wlr_log(WLR_ERROR, "Cannot create wlr_backend");
+	struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
+	assert(loop);
+
+	/*
+	 * Start the keymap compiler and ask for the current layout right away,
+	 * so that compiling it overlaps with the rest of initialization.  The
+	 * result is delivered from the event loop, by which time the keyboard
+	 * exists.
+	 *
+	 * Its worker is one of two threads besides this one.  The other is the
+	 * vchan reader that qubes_backend_create() starts in the Rust code.  The
+	 * keymap worker only uses libxkbcommon objects of its own, and the reader
+	 * only uses the vchan, under the lock of Shared::link, handing messages
+	 * over through an eventfd.  Both block all signals.  Neither touches
+	 * wlroots or libwayland, so everything check_single_threaded() protected
+	 * still runs on this thread only.
+	 */
+	if (!(server->keymap_compiler =
+	         qubes_keymap_compiler_create(loop, qubes_keymap_ready, server))) {
+		wlr_log(WLR_ERROR, "Cannot create keymap compiler");
 		return 1;
 	}
 
+	/* Refresh keyboard layout from qubesdb */
+	qubes_refresh_keyboard_layout(server);
+	qubes_startup_phase(&startup, "keymap request");
+
 	if (!(server->renderer = wlr_pixman_renderer_create())) {
 		wlr_log(WLR_ERROR, "Cannot create Pixman renderer");
 		return 1;
@@ -816,12 +926,7 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	/* Configure a listener to be notified when new outputs are available on the
-	 * backend. */
 	wl_list_init(&server->outputs);
-	server->new_output.notify = server_new_output;
-	wl_signal_add(&server->backend->backend.events.new_output,
-	              &server->new_output);
 
 	/* Set up our list of views and the xdg-shell. The xdg-shell is a Wayland
 	 * protocol which is used for application windows. For more detail on
@@ -830,6 +935,7 @@ int main(int argc, char *argv[])
 	 * https://drewdevault.com/2018/07/29/Wayland-shells.html
 	 */
 	wl_list_init(&server->views);
+	wl_list_init(&server->spare_outputs);
 	if (!(server->xdg_shell = wlr_xdg_shell_create(server->wl_display, 3))) {
 		wlr_log(WLR_ERROR, "Cannot create xdg_shell");
 		return 1;
@@ -846,9 +952,6 @@ int main(int argc, char *argv[])
 	 * let us know when new input devices are available on the backend.
 	 */
 	wl_list_init(&server->keyboards);
-	server->new_input.notify = server_new_input;
-	wl_signal_add(&server->backend->backend.events.new_input,
-	              &server->new_input);
 	if (!(server->seat = wlr_seat_create(server->wl_display, "seat0"))) {
 		wlr_log(WLR_ERROR, "Cannot create wlr_seat");
 		return 1;
@@ -858,20 +961,23 @@ int main(int argc, char *argv[])
 	wl_signal_add(&server->seat->events.request_set_selection,
 	              &server->request_set_selection);
 
-	/* Add a Unix socket to the Wayland display. */
+	qubes_startup_phase(&startup, "globals");
+
+	/* Add a Unix socket to the Wayland display.  This is done before
+	 * connecting to the GUI daemon, so that clients started early queue up
+	 * in the listen backlog instead of failing to connect. */
 	const char *socket_path = wl_display_add_socket_auto(server->wl_display);
 	if (!socket_path) {
 		wlr_log(WLR_ERROR, "Cannot listen on Wayland socket");
-		wlr_backend_destroy(&server->backend->backend);
 		return 1;
 	}
 
 	wlr_log(WLR_INFO, "Socket path: %s", socket_path);
-	/* Create XWayland */
+	/* Create XWayland.  It is lazy: the X server is only started when the
+	 * first X11 client connects to its socket. */
 	if (enable_xwayland && !(server->xwayland = wlr_xwayland_create(
 	                            server->wl_display, server->compositor, true))) {
 		wlr_log(WLR_ERROR, "Cannot create Xwayland device");
-		wlr_backend_destroy(&server->backend->backend);
 		return 1;
 	}
 
@@ -883,8 +989,31 @@ int main(int argc, char *argv[])
 			      &server->new_xwayland_surface);
 	}
 
-	struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
-	assert(loop);
+	qubes_startup_phase(&startup, "socket");
+
+	/* The backend is a wlroots feature which abstracts the underlying input and
+	 * output hardware.  Creating it connects to the GUI daemon, which blocks
+	 * until the daemon is there, so it comes after everything that does not
+	 * need it. */
+	if (!(server->backend =
+	         qubes_backend_create(server->wl_display, domid, &server->views))) {
+		wlr_log(WLR_ERROR, "Cannot create wlr_backend");
+		return 1;
+	}
+	server->backend->server = server;
+	/* Every window's frame callbacks are paced at this rate */
+	server->backend->mode.refresh = (int32_t)(refresh_hz * 1000);
+	qubes_startup_phase(&startup, "GUI daemon connection");
+
+	/* Configure listeners to be notified when new outputs and input devices
+	 * are available on the backend. */
+	server->new_output.notify = server_new_output;
+	wl_signal_add(&server->backend->backend.events.new_output,
+	              &server->new_output);
+	server->new_input.notify = server_new_input;
+	wl_signal_add(&server->backend->backend.events.new_input,
+	              &server->new_input);
+
 	assert(qdb);
 
 	if (!(server->qubesdb_watcher =
@@ -894,13 +1023,6 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (!(server->timer = wl_event_loop_add_timer(
-	         loop, qubes_send_frame_callbacks, server))) {
-		wlr_log(WLR_ERROR, "Cannot create timer");
-		return 1;
-	}
-	wl_event_source_timer_update(server->timer, 16);
-
 	/* Start the backend. This will enumerate outputs and inputs, become the DRM
 	 * master, etc */
 	if (!wlr_backend_start(&server->backend->backend)) {
@@ -908,12 +1030,10 @@ int main(int argc, char *argv[])
 		wl_display_destroy(server->wl_display);
 		return 1;
 	}
-
-	/* Refresh keyboard layout from qubesdb */
-	qubes_refresh_keyboard_layout(server);
+	qubes_startup_phase(&startup, "backend start");
 
 	/*
-	 * Add signal handlers for SIGTERM, SIGINT, and SIGHUP
+	 * Add signal handlers for SIGTERM, SIGINT, SIGHUP, and SIGUSR1
 	 */
 	struct wl_event_source *sigint =
 	   handle_sigint
@@ -923,7 +1043,9 @@ int main(int argc, char *argv[])
 	   wl_event_loop_add_signal(loop, SIGTERM, qubes_clean_exit, server);
 	struct wl_event_source *sighup =
 	   wl_event_loop_add_signal(loop, SIGHUP, qubes_clean_exit, server);
-	if (!sigterm || (handle_sigint && !sigint) || !sighup) {
+	struct wl_event_source *sigusr1 =
+	   wl_event_loop_add_signal(loop, SIGUSR1, qubes_log_stats, server);
+	if (!sigterm || (handle_sigint && !sigint) || !sighup || !sigusr1) {
 #ifdef QUBES_HAS_SYSTEMD
 		sd_notifyf(0, "ERRNO=%d", errno);
 #endif
@@ -946,6 +1068,8 @@ int main(int argc, char *argv[])
 	 * compositor. Starting the backend rigged up all of the necessary event
 	 * loop configuration to listen to libinput events, DRM events, generate
 	 * frame events at the refresh rate, and so on. */
+	wlr_log(WLR_INFO, "Startup took %" PRIu64 " us: %s",
+	        startup.last_us - startup.start_us, startup.summary);
 	wlr_log(WLR_INFO, "Running Wayland compositor on WAYLAND_DISPLAY=%s",
 	        socket_path);
 	sd_notifyf(0, "Running Wayland compositor on WAYLAND_DISPLAY=%s",
@@ -956,13 +1080,15 @@ int main(int argc, char *argv[])
 	/* Once wl_display_run returns, we shut down the server */
 	wl_display_destroy_clients(server->wl_display);
 	wl_event_source_remove(sighup);
+	wl_event_source_remove(sigusr1);
 	if (sigint)
 		wl_event_source_remove(sigint);
 	wl_event_source_remove(sigterm);
-	wl_event_source_remove(server->timer);
 	wl_event_source_remove(server->qubesdb_watcher);
+	qubes_keymap_compiler_destroy(server->keymap_compiler);
 	if (server->xwayland)
 		wlr_xwayland_destroy(server->xwayland);
+	qubes_output_free_spares(server);
 
 	struct tinywl_keyboard *keyboard_to_free, *tmp_keyboard;
 	wl_list_for_each_safe (keyboard_to_free, tmp_keyboard, &server->keyboards,
@@ -972,6 +1098,8 @@ int main(int argc, char *argv[])
 		wl_list_remove(&keyboard_to_free->link);
 	}
 	wlr_renderer_destroy(server->renderer);
+	qubes_dump_ring_release(&server->dumps);
+	free(server->dumps.dumps);
 	wlr_allocator_destroy(server->allocator);
 	wlr_output_layout_destroy(server->output_layout);
 	wl_display_destroy(server->wl_display);
@@ -2,12 +2,15 @@
 #define QUBES_WAYLAND_COMPOSITOR_MAIN_H                                        \
 	_Pragma("GCC error \"double-include guard referenced\"")
 #include "common.h"
+#include "qubes_output.h"
 #include <wlr/types/wlr_subcompositor.h>
 #include <wlr/util/box.h>
 
 #include <qubes-gui-protocol.h>
 #include <qubesdb-client.h>
 void qubes_rust_send_message(void *backend, struct msg_hdr *header);
+/* Takes ownership of header, which must come from malloc() */
+void qubes_rust_send_bulk(void *backend, struct msg_hdr *header);
 void qubes_rust_delete_id(void *backend, uint32_t id);
 
 struct wlr_surface;
@@ -37,14 +40,15 @@ struct tinywl_keyboard {
 struct tinywl_server {
 	struct wl_display *wl_display;
 	struct qubes_backend *backend;
-	struct qubes_link *queue_head;
-	struct qubes_link *queue_tail;
+	struct qubes_dump_ring dumps; /* MSG_WINDOW_DUMP awaiting an ACK */
 	struct wlr_renderer *renderer;
 	struct wlr_allocator *allocator;
 
 	struct wlr_xdg_shell *xdg_shell;
 	struct wl_listener new_xdg_surface, new_xwayland_surface;
 	struct wl_list views;
+	struct wl_list spare_outputs; /* parked popups, see qubes_output_park() */
+	uint32_t n_spare_outputs;
 
 	struct wlr_seat *seat;
 	struct wl_listener new_input;
@@ -62,20 +66,29 @@ struct tinywl_server {
 	struct wlr_server_decoration_manager *old_manager;
 	struct wlr_xdg_decoration_manager_v1 *new_manager;
 	struct wl_listener new_decoration;
-	struct wl_event_source *timer, *qubesdb_watcher;
+	struct wl_event_source *qubesdb_watcher;
 	struct wlr_compositor *compositor;
 	struct wlr_subcompositor *subcompositor;
 	struct wlr_data_device_manager *data_device;
 	struct wlr_xwayland *xwayland;
 	struct tinywl_keyboard keyboard;
+	struct qubes_keymap_compiler *keymap_compiler;
 	qdb_handle_t qubesdb_connection;
 	uint32_t magic;
 	uint16_t domid;
-	bool frame_pending, vchan_error;
+	bool vchan_error;
 	uint64_t output_counter;
 	int listening_socket;
 	uint8_t exit_status;
 	bool keymap_errors_fatal;
+	/* Damage diffing, see qubes_output_diff_damage() */
+	struct {
+		size_t shadow_limit;   /* bytes of shadow per window, 0 to disable */
+		uint64_t pixel_budget; /* pixels compared per window per frame */
+	} diff;
+	/* Buffers at least this big are copied into a stable one, 0 to disable.
+	 * See qubes_output_wants_stable_buffer(). */
+	size_t stable_buffer_bytes;
 };
 
 #endif
@@ -5,12 +5,14 @@
 #endif
 #define _POSIX_C_SOURCE 200809L
 #include "common.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <wlr/interfaces/wlr_buffer.h>
@@ -36,6 +38,8 @@ static bool qubes_buffer_begin_data_ptr_access(struct wlr_buffer *buffer,
                                                uint32_t *format,
                                                size_t *stride);
 static void qubes_allocator_decref(struct qubes_allocator *allocator);
+static void qubes_pool_trim(struct qubes_allocator *qalloc, uint64_t now,
+                            size_t max_bytes);
 
 static const struct wlr_allocator_interface qubes_allocator_impl = {
 	.create_buffer = qubes_buffer_create,
@@ -55,16 +59,41 @@ static const struct wlr_buffer_impl qubes_buffer_impl = {
 };
 const struct wlr_buffer_impl *qubes_buffer_impl_addr = &qubes_buffer_impl;
 
+enum {
+	/* Buckets of the buffer pool, indexed by log2 of the page count */
+	QUBES_POOL_BUCKETS = 32,
+	/* Maximum amount of idle grant memory kept in the pool */
+	QUBES_POOL_MAX_BYTES = 64 << 20,
+	/* Idle buffers older than this are freed on the next pool operation */
+	QUBES_POOL_MAX_AGE_MS = 5000,
+};
+
 struct qubes_allocator {
 	struct wlr_allocator inner;
 	uint64_t refcount;
 	int xenfd;
 	uint16_t domid;
+	bool pool_enabled;
+	size_t pool_bytes;
+	/* struct qubes_buffer::bucket_link, newest first */
+	struct wl_list pool[QUBES_POOL_BUCKETS];
+	/* struct qubes_buffer::lru_link, newest first */
+	struct wl_list pool_lru;
+	/* Grant accounting */
+	uint64_t buffers;         /* live and pooled buffers */
+	uint64_t grant_refs;      /* refs held by live and pooled buffers */
+	uint64_t peak_grant_refs; /* maximum of grant_refs */
+	uint64_t allocations;     /* buffers created with fresh grant refs */
+	uint64_t grant_failures;  /* failed IOCTL_GNTALLOC_ALLOC_GREF calls */
+	uint64_t pool_hits;       /* buffers created from the pool */
+	uint64_t pool_flushes;    /* pool emptied to retry an allocation */
 };
 
 static void qubes_allocator_destroy(struct wlr_allocator *allocator)
 {
 	struct qubes_allocator *qubes = wl_container_of(allocator, qubes, inner);
+	/* Pooled buffers must be deallocated while the Xen FD is still open */
+	qubes_pool_trim(qubes, 0, 0);
 	assert(close(qubes->xenfd) == 0 &&
 	       "Closing a gntalloc handle always succeeds");
 	qubes->xenfd = -1;
@@ -98,6 +127,9 @@ struct wlr_allocator *qubes_allocator_create(uint16_t domid)
 	} else {
 		assert(qubes->xenfd > 2 && "FD 0, 1, or 2 got closed earlier?");
 		qubes->refcount = 1;
+		for (size_t i = 0; i < QUBES_POOL_BUCKETS; ++i)
+			wl_list_init(&qubes->pool[i]);
+		wl_list_init(&qubes->pool_lru);
 		wlr_allocator_init(&qubes->inner, &qubes_allocator_impl,
 		                   WLR_BUFFER_CAP_DATA_PTR);
 		return &qubes->inner;
@@ -107,17 +139,185 @@ struct wlr_allocator *qubes_allocator_create(uint16_t domid)
 #define XC_PAGE_SIZE 4096
 #endif
 
-static void report_gntalloc_error(void)
+static uint64_t qubes_monotonic_ms(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/*
+ * Round a page count up so that buffers of slightly different sizes, such as
+ * the ones allocated during an interactive resize, get the same number of
+ * grant refs and can replace each other.  At most 1/8 of a buffer is wasted.
+ */
+static uint32_t qubes_pool_round_pages(uint32_t pages)
+{
+	if (pages < 16)
+		return pages;
+	uint32_t const granule = UINT32_C(1) << (28 - __builtin_clz(pages));
+	return (pages + granule - 1) & ~(granule - 1);
+}
+
+static unsigned int qubes_pool_bucket(uint32_t pages)
+{
+	assert(pages > 0);
+	return 31 - (unsigned int)__builtin_clz(pages);
+}
+
+/* Unmap and deallocate a buffer that is not referenced by anything. */
+static void qubes_buffer_free(struct qubes_buffer *buffer)
+{
+	struct qubes_allocator *qalloc = buffer->alloc;
+	struct ioctl_gntalloc_dealloc_gref dealloc = {
+		.index = buffer->index,
+		.count = buffer->pages,
+	};
+	assert(munmap(buffer->ptr, (size_t)buffer->pages * XC_PAGE_SIZE) == 0);
+	if (qalloc->xenfd != -1)
+		assert(ioctl(qalloc->xenfd, IOCTL_GNTALLOC_DEALLOC_GREF, &dealloc) ==
+		       0);
+	assert(qalloc->buffers > 0 && qalloc->grant_refs >= buffer->pages &&
+	       "grant accounting is wrong");
+	qalloc->buffers--;
+	qalloc->grant_refs -= buffer->pages;
+	free(buffer);
+	qubes_allocator_decref(qalloc);
+}
+
+static void qubes_pool_remove(struct qubes_allocator *qalloc,
+                              struct qubes_buffer *buffer)
+{
+	size_t const bytes = (size_t)buffer->pages * XC_PAGE_SIZE;
+	assert(qalloc->pool_bytes >= bytes && "pool accounting is wrong");
+	qalloc->pool_bytes -= bytes;
+	wl_list_remove(&buffer->bucket_link);
+	wl_list_remove(&buffer->lru_link);
+}
+
+/*
+ * Free the oldest pooled buffers until at most max_bytes are pooled and no
+ * buffer has been idle for longer than QUBES_POOL_MAX_AGE_MS.
+ */
+static void qubes_pool_trim(struct qubes_allocator *qalloc, uint64_t now,
+                            size_t max_bytes)
+{
+	while (!wl_list_empty(&qalloc->pool_lru)) {
+		struct qubes_buffer *oldest =
+		   wl_container_of(qalloc->pool_lru.prev, oldest, lru_link);
+		if (qalloc->pool_bytes <= max_bytes &&
+		    now - oldest->pooled < QUBES_POOL_MAX_AGE_MS)
+			break;
+		qubes_pool_remove(qalloc, oldest);
+		qubes_buffer_free(oldest);
+	}
+}
+
+static struct qubes_buffer *qubes_pool_take(struct qubes_allocator *qalloc,
+                                            uint32_t pages)
+{
+	struct qubes_buffer *buffer;
+	qubes_pool_trim(qalloc, qubes_monotonic_ms(), QUBES_POOL_MAX_BYTES);
+	wl_list_for_each (buffer, &qalloc->pool[qubes_pool_bucket(pages)],
+	                  bucket_link) {
+		if (buffer->pages == pages) {
+			qubes_pool_remove(qalloc, buffer);
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Try to put a buffer in the pool instead of freeing it.  The pooled buffer
+ * keeps its grant refs, its mapping, and its reference to the allocator.
+ */
+static bool qubes_pool_put(struct qubes_allocator *qalloc,
+                           struct qubes_buffer *buffer)
+{
+	size_t const bytes = (size_t)buffer->pages * XC_PAGE_SIZE;
+	if (!qalloc->pool_enabled || qalloc->xenfd == -1 ||
+	    bytes > QUBES_POOL_MAX_BYTES)
+		return false;
+	buffer->pooled = qubes_monotonic_ms();
+	wl_list_insert(&qalloc->pool[qubes_pool_bucket(buffer->pages)],
+	               &buffer->bucket_link);
+	wl_list_insert(&qalloc->pool_lru, &buffer->lru_link);
+	qalloc->pool_bytes += bytes;
+	qubes_pool_trim(qalloc, buffer->pooled, QUBES_POOL_MAX_BYTES);
+	return true;
+}
+
+void qubes_allocator_set_pool_enabled(struct wlr_allocator *alloc,
+                                      bool enabled)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	qalloc->pool_enabled = enabled;
+	if (!enabled)
+		qubes_pool_trim(qalloc, 0, 0);
+}
+
+/* Set up the parts of a buffer that depend on the requested dimensions */
+static struct wlr_buffer *qubes_buffer_init(struct qubes_buffer *buffer,
+                                            int width, int height,
+                                            uint32_t format, size_t bytes)
+{
+	buffer->refcount = 1;
+	buffer->size = bytes;
+	buffer->format = format;
+	buffer->qubes.type = 0; /* WINDOW_DUMP_TYPE_GRANT_REFS */
+	buffer->qubes.width = (uint32_t)width;
+	buffer->qubes.height = (uint32_t)height;
+	buffer->qubes.bpp = 24;
+	wlr_buffer_init(&buffer->inner, &qubes_buffer_impl, width, height);
+	return &buffer->inner;
+}
+
+static void report_gntalloc_error(const struct qubes_allocator *qalloc,
+                                  int32_t pages)
 {
 	const int err = errno;
 	char buf[256];
 	int e = strerror_r(err, buf, sizeof buf);
 	buf[sizeof buf - 1] = '\0';
 	if (e != 0) {
-		wlr_log(WLR_ERROR, "Grant ref alloc failed with unknown error %d", err);
+		wlr_log(WLR_ERROR,
+		        "Grant ref alloc of %" PRIi32 " refs failed with unknown error "
+		        "%d (%" PRIu64 " refs in use)",
+		        pages, err, qalloc->grant_refs);
 	} else {
-		wlr_log(WLR_ERROR, "Grant ref alloc failed with errno %d: %s", err, buf);
+		wlr_log(WLR_ERROR,
+		        "Grant ref alloc of %" PRIi32 " refs failed with errno %d: %s "
+		        "(%" PRIu64 " refs in use)",
+		        pages, err, buf, qalloc->grant_refs);
+	}
+	errno = err;
+}
+
+/*
+ * Allocate grant refs for a buffer.  If gntalloc is out of refs, the idle
+ * buffers in the pool are the only thing that can be given back without
+ * disturbing a window, so flush the pool and try once more.
+ */
+static int qubes_buffer_alloc_grefs(struct qubes_allocator *qalloc,
+                                    struct qubes_buffer *buffer)
+{
+	int res = ioctl(qalloc->xenfd, IOCTL_GNTALLOC_ALLOC_GREF, &buffer->xen);
+	if (res && errno == ENOSPC && !wl_list_empty(&qalloc->pool_lru)) {
+		wlr_log(WLR_INFO,
+		        "Out of grant refs, freeing %zu bytes of pooled buffers",
+		        qalloc->pool_bytes);
+		qalloc->pool_flushes++;
+		qubes_pool_trim(qalloc, 0, 0);
+		res = ioctl(qalloc->xenfd, IOCTL_GNTALLOC_ALLOC_GREF, &buffer->xen);
 	}
+	if (res) {
+		assert(res == -1);
+		qalloc->grant_failures++;
+		report_gntalloc_error(qalloc, (int32_t)buffer->xen.count);
+	}
+	return res;
 }
 
 static struct wlr_buffer *
@@ -161,9 +361,20 @@ qubes_buffer_create(struct wlr_allocator *alloc, const int width,
 	/* the remaining computations cannot overflow */
 	const int32_t pixels = (int32_t)width * (int32_t)height;
 	const int32_t bytes = pixels * sizeof(uint32_t);
-	const int32_t pages = NUM_PAGES(bytes);
+	const int32_t pages = qalloc->pool_enabled
+	                         ? (int32_t)qubes_pool_round_pages(NUM_PAGES(bytes))
+	                         : NUM_PAGES(bytes);
 
-	struct qubes_buffer *buffer =
+	struct qubes_buffer *buffer = qubes_pool_take(qalloc, (uint32_t)pages);
+	if (buffer) {
+		qalloc->pool_hits++;
+		wlr_log(WLR_DEBUG, "Recycling pooled buffer of %" PRIu32 " pages",
+		        buffer->pages);
+		return qubes_buffer_init(buffer, width, height, format->format,
+		                         (size_t)bytes);
+	}
+
+	buffer =
 	   calloc((size_t)pages * SIZEOF_GRANT_REF +
 	             offsetof(struct qubes_buffer, qubes) + sizeof(buffer->qubes),
 	          1);
@@ -175,30 +386,31 @@ qubes_buffer_create(struct wlr_allocator *alloc, const int width,
 	buffer->xen.flags = GNTALLOC_FLAG_WRITABLE;
 	buffer->xen.count = pages;
 	buffer->format = format->format;
-	int res = ioctl(qalloc->xenfd, IOCTL_GNTALLOC_ALLOC_GREF, &buffer->xen);
-	if (res) {
-		assert(res == -1);
-		report_gntalloc_error();
+	if (qubes_buffer_alloc_grefs(qalloc, buffer))
 		goto fail;
-	}
 	buffer->index = buffer->xen.index;
-	buffer->refcount = 1;
-	buffer->size = (size_t)bytes;
-	buffer->qubes.type = 0; /* WINDOW_DUMP_TYPE_GRANT_REFS */
-	buffer->qubes.width = (uint32_t)width;
-	buffer->qubes.height = (uint32_t)height;
-	buffer->qubes.bpp = 24;
-	buffer->ptr = mmap(NULL, (size_t)bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
-	                   qalloc->xenfd, (off_t)buffer->index);
+	buffer->pages = (uint32_t)pages;
+	buffer->ptr = mmap(NULL, (size_t)pages * XC_PAGE_SIZE,
+	                   PROT_READ | PROT_WRITE, MAP_SHARED, qalloc->xenfd,
+	                   (off_t)buffer->index);
 	if (buffer->ptr != MAP_FAILED) {
-		wlr_buffer_init(&buffer->inner, &qubes_buffer_impl, width, height);
 		qalloc->refcount++;
 		assert(qalloc->refcount);
 		buffer->alloc = qalloc;
-		return &buffer->inner;
+		qalloc->allocations++;
+		qalloc->buffers++;
+		qalloc->grant_refs += (uint32_t)pages;
+		qalloc->peak_grant_refs =
+		   QUBES_MAX(qalloc->peak_grant_refs, qalloc->grant_refs);
+		wlr_log(WLR_DEBUG,
+		        "Granted %" PRIi32 " refs for a %dx%d buffer, %" PRIu64
+		        " refs in %" PRIu64 " buffers in use",
+		        pages, width, height, qalloc->grant_refs, qalloc->buffers);
+		return qubes_buffer_init(buffer, width, height, format->format,
+		                         (size_t)bytes);
 	}
 fail:
-	if (buffer->size) {
+	if (buffer->pages) {
 		struct ioctl_gntalloc_dealloc_gref dealloc = {
 			.index = buffer->index,
 			.count = pages,
@@ -209,6 +421,19 @@ fail:
 	return NULL;
 }
 
+void qubes_allocator_log_stats(struct wlr_allocator *alloc)
+{
+	assert(alloc->impl == &qubes_allocator_impl);
+	struct qubes_allocator *qalloc = wl_container_of(alloc, qalloc, inner);
+	wlr_log(WLR_INFO,
+	        "Grants: %" PRIu64 " refs in %" PRIu64 " buffers (%zu bytes "
+	        "pooled), peak %" PRIu64 " refs, %" PRIu64 " allocations, %" PRIu64
+	        " failed, %" PRIu64 " pool hits, %" PRIu64 " pool flushes",
+	        qalloc->grant_refs, qalloc->buffers, qalloc->pool_bytes,
+	        qalloc->peak_grant_refs, qalloc->allocations, qalloc->grant_failures,
+	        qalloc->pool_hits, qalloc->pool_flushes);
+}
+
 static bool qubes_buffer_begin_data_ptr_access(struct wlr_buffer *raw_buffer,
                                                uint32_t flags, void **data,
                                                uint32_t *format, size_t *stride)
@@ -237,16 +462,9 @@ void qubes_buffer_destroy(struct wlr_buffer *raw_buffer)
 		return;
 	}
 	assert(buffer->refcount == 1);
-	struct ioctl_gntalloc_dealloc_gref dealloc = {
-		.index = buffer->index,
-		.count = NUM_PAGES(buffer->size),
-	};
-	assert(munmap(buffer->ptr, buffer->size) == 0);
-	if (buffer->alloc->xenfd != -1)
-		assert(ioctl(buffer->alloc->xenfd, IOCTL_GNTALLOC_DEALLOC_GREF,
-		             &dealloc) == 0);
-	qubes_allocator_decref(buffer->alloc);
-	free(buffer);
+	buffer->refcount = 0;
+	if (!qubes_pool_put(buffer->alloc, buffer))
+		qubes_buffer_free(buffer);
 }
 
 // vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -11,6 +11,20 @@
  * Creates an allocator, owned by main()
  */
 struct wlr_allocator *qubes_allocator_create(uint16_t domid);
+
+/**
+ * Enable or disable recycling of grant buffers.  Recycling is only safe once
+ * the GUI daemon acknowledges every MSG_WINDOW_DUMP (protocol 1.7 and later),
+ * as otherwise the daemon might still be displaying a buffer that gets
+ * handed to another window.  Disabling recycling frees every pooled buffer.
+ */
+void qubes_allocator_set_pool_enabled(struct wlr_allocator *alloc,
+                                      bool enabled);
+
+/**
+ * Log how many grant refs are in use, for debugging grant exhaustion.
+ */
+void qubes_allocator_log_stats(struct wlr_allocator *alloc);
 extern const struct wlr_buffer_impl *qubes_buffer_impl_addr;
 void qubes_buffer_destroy(struct wlr_buffer *buffer);
 
@@ -23,7 +37,10 @@ struct qubes_buffer {
 	void *ptr;
 	struct qubes_allocator *alloc;
 	uint64_t index;
-	size_t size;
+	size_t size;     /* bytes in use by the current wlr_buffer */
+	uint32_t pages;  /* pages granted, may exceed NUM_PAGES(size) */
+	uint64_t pooled; /* CLOCK_MONOTONIC ms when put in the pool */
+	struct wl_list bucket_link, lru_link; /* only valid while pooled */
 	union {
 		struct {
 			uint32_t format;
@@ -51,6 +51,9 @@ static void qubes_backend_handle_display_destroy(struct wl_listener *listener,
 static bool qubes_backend_start(struct wlr_backend *raw_backend);
 extern void qubes_rust_backend_free(void *ptr);
 extern void *qubes_rust_backend_create(uint16_t domid);
+extern void qubes_rust_backend_set_flush_callback(
+   struct qubes_rust_backend *backend, bool (*callback)(void *),
+   void *userdata);
 typedef void (*qubes_parse_event_callback)(void *raw_view, void *raw_backend,
                                            uint32_t timestamp,
                                            struct msg_hdr hdr,
@@ -101,6 +104,30 @@ int qubes_backend_on_fd(int fd __attribute__((unused)), uint32_t mask,
 	return 0;
 }
 
+static int qubes_backend_flush(void *data)
+{
+	struct qubes_backend *backend = data;
+	backend->flush_source = NULL; /* idle sources are one-shot */
+	qubes_rust_flush(backend->rust_backend);
+	return 0;
+}
+
+/*
+ * Called by the Rust code when the first message of a batch is queued.  The
+ * idle source runs once the current event loop iteration has dispatched all
+ * pending events, so everything sent during the iteration is written at once.
+ */
+static bool qubes_backend_schedule_flush(void *data)
+{
+	struct qubes_backend *backend = data;
+	if (backend->flush_source)
+		return true;
+	backend->flush_source =
+	   wl_event_loop_add_idle(wl_display_get_event_loop(backend->display),
+	                          qubes_backend_flush, backend);
+	return backend->flush_source != NULL;
+}
+
 static void qubes_backend_destroy(struct qubes_backend *backend)
 {
 	wlr_keyboard_finish(backend->keyboard);
@@ -113,6 +140,12 @@ static void qubes_backend_destroy(struct qubes_backend *backend)
 	// descriptor.
 	if (backend->source)
 		wl_event_source_remove(backend->source);
+	if (backend->flush_source)
+		wl_event_source_remove(backend->flush_source);
+	if (backend->recreate_timer)
+		wl_event_source_remove(backend->recreate_timer);
+	if (backend->rust_backend)
+		qubes_rust_flush(backend->rust_backend);
 	qubes_rust_backend_free(backend->rust_backend);
 	wlr_output_destroy(backend->output);
 	if (backend->display_destroy.link.next)
@@ -161,6 +194,8 @@ struct qubes_backend *qubes_backend_create(struct wl_display *display,
 		        domid);
 		goto fail;
 	}
+	qubes_rust_backend_set_flush_callback(backend->rust_backend,
+	                                      qubes_backend_schedule_flush, backend);
 	backend->mode.width = 1920;
 	backend->mode.height = 1080;
 	backend->mode.refresh = 60000;
@@ -10,6 +10,7 @@
 #include <qubes-gui-protocol.h>
 
 struct qubes_rust_backend;
+struct tinywl_server;
 
 /**
  * Qubes OS backend.  Owned by the wl_display.
@@ -21,15 +22,26 @@ struct qubes_backend {
 	struct wlr_output *output;
 	struct qubes_rust_backend *rust_backend;
 	struct wl_event_source *source;
+	struct wl_event_source *flush_source; /* pending batch flush, if any */
+	struct wl_event_source *recreate_timer; /* see qubes_recreate_windows() */
 	struct msg_keymap_notify keymap;
 	struct wl_list *views;
+	struct tinywl_server *server; /* set by main() after creation */
 	struct wl_listener display_destroy;
 	struct wlr_keyboard *keyboard;
 	struct wlr_pointer *pointer;
 	uint32_t protocol_version;
 	bool connected;
 };
+/* Readable when messages from the GUI daemon are queued.  Does not change on
+ * reconnect.  See NOTE: Off-thread reading in qubes.rs. */
 extern int qubes_rust_backend_fd(struct qubes_rust_backend *backend);
+/* Send all batched messages.  See NOTE: Message batching in qubes.rs. */
+extern void qubes_rust_flush(struct qubes_rust_backend *backend);
+/* Number of MSG_MOTION events merged into a later one.  See NOTE: Motion
+ * coalescing in qubes.rs. */
+extern uint64_t
+qubes_rust_coalesced_motion_events(struct qubes_rust_backend *backend);
 
 struct qubes_backend *qubes_backend_create(struct wl_display *, uint16_t,
                                            struct wl_list *);
@@ -48,6 +48,8 @@ qubes_clipboard_handler_on_display_destroy(struct wl_listener *listener,
 
 enum {
 	MAX_CLIPBOARD_MESSAGE_SIZE = MAX_CLIPBOARD_SIZE + sizeof(struct msg_hdr),
+	/* One default pipe buffer, so that small selections need one read */
+	CLIPBOARD_INITIAL_ALLOC = 1 << 16,
 };
 
 static int qubes_on_clipboard_data(int const fd, uint32_t const mask,
@@ -60,17 +62,20 @@ static int qubes_on_clipboard_data(int const fd, uint32_t const mask,
 	assert(fd == handler->fd && "Wrong file descriptor");
 	wlr_log(WLR_DEBUG, "Processing clipboard data from client");
 	assert(clipboard_data->size <= clipboard_data->alloc && "corrupt wl_array");
-retry:;
 	size_t const size = clipboard_data->size;
 	assert(clipboard_data->size <= (size_t)MAX_CLIPBOARD_MESSAGE_SIZE &&
 	       "already made array too large?");
 	if (clipboard_data->alloc <= size) {
-		size_t size = clipboard_data->size;
-		if (!(ptr = wl_array_add(
-		         clipboard_data,
-		         QUBES_MIN(size + 0xFF, (size_t)MAX_CLIPBOARD_MESSAGE_SIZE + 1))))
+		// Double the buffer, so reading n bytes takes O(log n) reallocations.
+		// wl_array_add() reserves the space, which is then handed back until
+		// read() fills it.
+		size_t const target = QUBES_MIN(
+		   QUBES_MAX(clipboard_data->alloc * 2, (size_t)CLIPBOARD_INITIAL_ALLOC),
+		   (size_t)MAX_CLIPBOARD_MESSAGE_SIZE + 1);
+		if (!(ptr = wl_array_add(clipboard_data, target - size)))
 			goto done;
 		assert(ptr == (char *)clipboard_data->data + size);
+		clipboard_data->size = size;
 	} else {
 		ptr = (char *)clipboard_data->data + size;
 	}
@@ -89,8 +94,10 @@ retry:;
 		assert(clipboard_data->size >= sizeof header && "Data too small???");
 		memcpy(clipboard_data->data, &header, sizeof header);
 		wlr_log(WLR_DEBUG, "Setting clipboard data");
-		qubes_rust_send_message(handler->server->backend->rust_backend,
-		                        clipboard_data->data);
+		/* The selection can be megabytes, so hand it over instead of copying */
+		qubes_rust_send_bulk(handler->server->backend->rust_backend,
+		                     clipboard_data->data);
+		wl_array_init(clipboard_data);
 		goto done;
 	} else if (res == -1) {
 		int err = errno;
@@ -123,7 +130,10 @@ retry:;
 		}
 		assert(clipboard_data->size <= clipboard_data->alloc &&
 		       "corrupt wl_array");
-		goto retry;
+		// Wait for the pipe to be readable again instead of draining it, so
+		// that a large selection does not hold up input and frames.  The
+		// event loop is level-triggered, so no data is missed.
+		return 0;
 	}
 done:
 	qubes_clipboard_handler_destroy(handler);
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <endian.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
@@ -38,6 +39,7 @@
 #include "qubes_clipboard.h"
 #include "qubes_data_source.h"
 #include "qubes_output.h"
+#include "qubes_trace.h"
 #include "qubes_wayland.h"
 #include "qubes_xwayland.h"
 
@@ -344,6 +346,13 @@ static void handle_window_flags(struct qubes_output *output, const uint8_t *ptr)
 		return;
 	}
 
+	/* Minimized windows stop drawing, whatever kind of window they are */
+	if (flags.flags_set & WINDOW_FLAG_MINIMIZE)
+		qubes_output_set_visibility(output, QUBES_OUTPUT_MINIMIZED);
+	else if ((flags.flags_unset & WINDOW_FLAG_MINIMIZE) &&
+	         output->visibility == QUBES_OUTPUT_MINIMIZED)
+		qubes_output_set_visibility(output, QUBES_OUTPUT_VISIBLE);
+
 	if (QUBES_VIEW_MAGIC != output->magic) {
 		assert(QUBES_XWAYLAND_MAGIC == output->magic);
 		wlr_log(WLR_ERROR,
@@ -414,6 +423,20 @@ static void handle_configure(struct qubes_output *output, uint32_t timestamp,
 		return;
 	}
 
+	struct tinywl_view *view = wl_container_of(output, view, output);
+	if ((output->flags & QUBES_OUTPUT_IGNORE_CLIENT_RESIZE) &&
+	    view->xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL) {
+		// The client has not caught up with the last size yet, so this one
+		// waits for it.  See qubes_view_set_size().
+		output->flags |= QUBES_OUTPUT_RESIZE_PENDING;
+		output->stats.configures_coalesced++;
+		output->guest.x = output->host.x = x;
+		output->guest.y = output->host.y = y;
+		output->host.width = width;
+		output->host.height = height;
+		return;
+	}
+
 	bool anything_changed =
 	   ((width != output->host.width) || (height != output->host.height) ||
 	    (x != output->host.x) || (y != output->host.y));
@@ -431,7 +454,8 @@ static void handle_configure(struct qubes_output *output, uint32_t timestamp,
 		if ((output->guest.width != width) || (output->guest.height != height)) {
 			output->guest.width = width;
 			output->guest.height = height;
-			wlr_output_update_custom_mode(&output->output, width, height, 60000);
+			wlr_output_update_custom_mode(&output->output, width, height,
+			                              output->refresh);
 			wlr_output_schedule_frame(&output->output);
 		} else if (QUBES_VIEW_MAGIC == output->magic) {
 			// This is basically a no-op, just ack
@@ -448,14 +472,8 @@ static void handle_configure(struct qubes_output *output, uint32_t timestamp,
 	// Ignore client-initiated resizes until this configure is ACKd, to
 	// avoid racing against the GUI daemon.
 	output->flags |= QUBES_OUTPUT_IGNORE_CLIENT_RESIZE;
-	struct tinywl_view *view = wl_container_of(output, view, output);
 	if (view->xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL) {
-		view->configure_serial = wlr_xdg_toplevel_set_size(
-			view->xdg_surface->toplevel, width, height);
-		wlr_log(WLR_DEBUG,
-				  "Will ACK configure from GUI daemon (width %u, height %u)"
-				  " when client ACKS configure with serial %u",
-				  width, height, view->configure_serial);
+		qubes_view_set_size(view);
 	} else {
 		// There won’t be a configure event ACKd by the client, so
 		// ACK early
@@ -515,6 +533,7 @@ static void handle_clipboard_request(struct qubes_output *output)
 // Called when the GUI agent has reconnected to the daemon.
 static void qubes_recreate_window(struct qubes_output *output)
 {
+	output->flags &= ~QUBES_OUTPUT_NEED_RECREATE;
 	if (!qubes_output_ensure_created(output)) {
 		return;
 	}
@@ -542,6 +561,68 @@ static void qubes_recreate_window(struct qubes_output *output)
 	}
 }
 
+enum {
+	/* Windows re-created per timer tick if the daemon does not ACK dumps */
+	QUBES_RECREATE_BATCH = 4,
+	/* Window dumps that may await an ACK while windows are re-created */
+	QUBES_RECREATE_MAX_PENDING_DUMPS = 16,
+};
+
+/*
+ * Re-creating every window at once after a reconnect stalls the compositor
+ * and floods the vchan, so windows are re-created a few at a time, mapped
+ * ones first.  Each batch is flushed to the vchan before the timer fires
+ * again.  With protocol 1.7 or later, the dumps awaiting an ACK are the send
+ * backlog, and each batch only fills the room the daemon has left.  Older
+ * daemons give no such feedback, so a small fixed batch per millisecond is
+ * the best that can be done.
+ */
+static int qubes_recreate_windows(void *data)
+{
+	struct qubes_backend *backend = data;
+	struct qubes_output *output;
+	uint32_t const backlog = backend->server->dumps.len;
+	uint32_t budget = QUBES_RECREATE_BATCH;
+	bool pending = false;
+
+	if (backend->protocol_version >= 0x10007)
+		budget = backlog >= QUBES_RECREATE_MAX_PENDING_DUMPS
+		            ? 0
+		            : QUBES_RECREATE_MAX_PENDING_DUMPS - backlog;
+	for (int pass = 0; pass < 2; ++pass) {
+		wl_list_for_each (output, backend->views, link) {
+			if (!(output->flags & QUBES_OUTPUT_NEED_RECREATE))
+				continue;
+			if (budget == 0) {
+				pending = true;
+				break;
+			}
+			if (pass == 0 && !(output->flags & QUBES_OUTPUT_MAPPED))
+				continue;
+			qubes_recreate_window(output);
+			budget--;
+		}
+	}
+	if (pending)
+		wl_event_source_timer_update(backend->recreate_timer, 1);
+	return 0;
+}
+
+/* The window with keyboard focus, if any */
+static struct qubes_output *qubes_focused_output(struct qubes_backend *backend)
+{
+	struct wlr_surface *focus =
+	   backend->server->seat->keyboard_state.focused_surface;
+	struct qubes_output *output;
+	if (focus) {
+		wl_list_for_each (output, backend->views, link) {
+			if (qubes_output_surface(output) == focus)
+				return output;
+		}
+	}
+	return NULL;
+}
+
 static void qubes_reconnect(struct qubes_backend *const backend,
                             uint32_t const msg_type,
                             uint32_t const protocol_version)
@@ -553,6 +634,10 @@ static void qubes_reconnect(struct qubes_backend *const backend,
 		unsigned int const minor_version = protocol_version & 0xFFFF;
 		backend->protocol_version = protocol_version;
 		assert(major_version == 1);
+		// Without MSG_WINDOW_DUMP_ACK there is no way to know when the daemon
+		// stops using a buffer, so buffers cannot be recycled.
+		qubes_allocator_set_pool_enabled(backend->server->allocator,
+		                                 protocol_version >= 0x10007);
 		sd_notifyf(
 		   0, "READY=1\nSTATUS=GUI daemon reconnected, protocol version %u.%u\n",
 		   major_version, minor_version);
@@ -561,16 +646,37 @@ static void qubes_reconnect(struct qubes_backend *const backend,
 		struct qubes_output *output;
 		wl_list_for_each (output, backend->views, link) {
 			output->flags &= ~QUBES_OUTPUT_CREATED;
+			output->flags |= QUBES_OUTPUT_NEED_RECREATE;
 		}
-		wl_list_for_each (output, backend->views, link) {
-			assert(!(output->flags & QUBES_OUTPUT_CREATED));
+		// The user is most likely interacting with the focused window
+		if ((output = qubes_focused_output(backend)))
 			qubes_recreate_window(output);
+		if (!backend->recreate_timer) {
+			backend->recreate_timer = wl_event_loop_add_timer(
+			   wl_display_get_event_loop(backend->display),
+			   qubes_recreate_windows, backend);
+		}
+		if (backend->recreate_timer) {
+			wl_event_source_timer_update(backend->recreate_timer, 1);
+		} else {
+			wlr_log(WLR_ERROR, "Cannot create timer, re-creating all windows");
+			wl_list_for_each (output, backend->views, link) {
+				if (output->flags & QUBES_OUTPUT_NEED_RECREATE)
+					qubes_recreate_window(output);
+			}
 		}
 		return;
 	}
 	case 1:
 		sd_notify(0, "STATUS=GUI daemon disconnected, trying to reconnect\n");
 		wlr_log(WLR_INFO, "Must reconnect to GUI daemon");
+		// The new daemon might speak an older protocol
+		qubes_allocator_set_pool_enabled(backend->server->allocator, false);
+		// The old daemon will never acknowledge its dumps
+		qubes_dump_ring_release(&backend->server->dumps);
+		// Windows are re-created once the new daemon is connected
+		if (backend->recreate_timer)
+			wl_event_source_timer_update(backend->recreate_timer, 0);
 		// GUI agent needs reconnection
 		if (backend->source)
 			wl_event_source_remove(backend->source);
@@ -609,6 +715,43 @@ static void qubes_reconnect(struct qubes_backend *const backend,
 	}
 }
 
+/*
+ * MSG_KEYMAP_NOTIFY carries the keys that are down, which the daemon sends
+ * on every focus change.  Keys that are down here but not there were released
+ * while another window had the focus.  The bitmaps are compared a word at a
+ * time, so a notify that changes nothing costs four word operations.
+ */
+static void handle_keymap_notify(struct qubes_backend *backend,
+                                 uint32_t timestamp, const uint8_t *ptr)
+{
+	struct wlr_keyboard *keyboard = backend->keyboard;
+	uint8_t *const keys = (uint8_t *)backend->keymap.keys;
+	assert(keyboard);
+	static_assert(sizeof(backend->keymap.keys) % sizeof(uint64_t) == 0,
+	              "keymap is not a whole number of words");
+	for (size_t i = 0; i < sizeof(backend->keymap.keys); i += sizeof(uint64_t)) {
+		uint64_t old_word, new_word;
+		memcpy(&old_word, keys + i, sizeof old_word);
+		memcpy(&new_word, ptr + i, sizeof new_word);
+		/* Byte n, bit m is keycode 8n+m, so this is in keycode order */
+		uint64_t released = le64toh(old_word & ~new_word);
+		while (released) {
+			uint32_t const keycode =
+			   (uint32_t)(i * 8) + (uint32_t)__builtin_ctzll(released);
+			released &= released - 1;
+			keys[keycode >> 3] &= (uint8_t) ~(1U << (keycode & 7));
+			struct wlr_keyboard_key_event event = {
+				.time_msec = timestamp,
+				.keycode = keycode,
+				.update_state = true,
+				.state = WL_KEYBOARD_KEY_STATE_RELEASED,
+			};
+			wlr_keyboard_notify_key(keyboard, &event);
+		}
+	}
+	memcpy(&backend->keymap, ptr, sizeof(backend->keymap));
+}
+
 void qubes_parse_event(void *raw_backend, void *raw_view, uint32_t timestamp,
                        struct msg_hdr hdr, const uint8_t *ptr)
 {
@@ -625,35 +768,35 @@ void qubes_parse_event(void *raw_backend, void *raw_view, uint32_t timestamp,
 		qubes_reconnect(backend, hdr.untrusted_len, hdr.window);
 		return;
 	}
+	QUBES_TRACE(receive, hdr.window, hdr.type, hdr.untrusted_len, timestamp);
+
+#define MSG_WINDOW_DUMP_ACK 149
+	if (hdr.type == MSG_WINDOW_DUMP_ACK) {
+		// Also sent for windows that have been destroyed since the dump, in
+		// which case output is NULL.
+		uint32_t const protocol_version = backend->protocol_version;
+		unsigned int const protocol_version_major = protocol_version >> 16;
+		unsigned int const protocol_version_minor = protocol_version & 0xFFFF;
+		if (protocol_version < 0x10007) {
+			wlr_log(WLR_ERROR,
+			        "Daemon sent MSG_WINDOW_DUMP_ACK but protocol version is %u.%u"
+			        "(less than 1.7)",
+			        protocol_version_major, protocol_version_minor);
+			return;
+		}
+		qubes_output_dump_acked(backend->server, hdr.window);
+		return;
+	}
 
 	if (!output) {
 		if (hdr.type != MSG_KEYMAP_NOTIFY) {
 			wlr_log(WLR_ERROR, "No window for message of type %" PRIu32, hdr.type);
 			return;
 		}
-		struct wlr_keyboard *keyboard = backend->keyboard;
-		assert(keyboard);
-		for (int i = 0; i < 32; ++i) {
-			for (int j = 0; j < 8; ++j) {
-				bool is_pressed = ptr[i] & 1 << j;
-				bool old_pressed = backend->keymap.keys[i] & 1 << j;
-				if (!old_pressed || is_pressed)
-					continue;
-				backend->keymap.keys[i] ^= 1 << j;
-				struct wlr_keyboard_key_event event = {
-					.time_msec = timestamp,
-					.keycode = i << 3 | j,
-					.update_state = true,
-					.state = is_pressed ? WL_KEYBOARD_KEY_STATE_PRESSED
-					                    : WL_KEYBOARD_KEY_STATE_RELEASED,
-				};
-				wlr_keyboard_notify_key(keyboard, &event);
-			}
-		}
 		assert(hdr.untrusted_len == sizeof(struct msg_keymap_notify));
 		static_assert(sizeof(backend->keymap) == sizeof(struct msg_keymap_notify),
 		              "wrong size");
-		memcpy(&backend->keymap, ptr, hdr.untrusted_len);
+		handle_keymap_notify(backend, timestamp, ptr);
 		return;
 	}
 	struct tinywl_server *server = output->server;
@@ -723,36 +866,6 @@ void qubes_parse_event(void *raw_backend, void *raw_view, uint32_t timestamp,
 	case MSG_DESTROY:
 		assert(0 && "handled by Rust code");
 		break;
-#define MSG_WINDOW_DUMP_ACK 149
-	case MSG_WINDOW_DUMP_ACK: {
-		uint32_t const protocol_version = backend->protocol_version;
-		unsigned int const protocol_version_major = protocol_version >> 16;
-		unsigned int const protocol_version_minor = protocol_version & 0xFFFF;
-		if (protocol_version < 0x10007) {
-			wlr_log(WLR_ERROR,
-			        "Daemon sent MSG_WINDOW_DUMP_ACK but protocol version is %u.%u"
-			        "(less than 1.7)",
-			        protocol_version_major, protocol_version_minor);
-			break;
-		}
-		struct qubes_link *link = server->queue_head;
-		if (link == NULL) {
-			assert(server->queue_tail == NULL);
-			wlr_log(WLR_ERROR,
-			        "Daemon sent too many MSG_WINDOW_DUMP_ACK messages");
-			break;
-		}
-		assert(server->queue_tail != NULL);
-		if ((server->queue_head = link->next) == NULL) {
-			assert(link == server->queue_tail);
-			server->queue_tail = NULL;
-		} else {
-			assert(link != server->queue_tail);
-		}
-		qubes_buffer_destroy(&link->buffer->inner);
-		free(link);
-		break;
-	}
 	case MSG_RESIZE:
 	case MSG_CREATE:
 	case MSG_UNMAP:
@@ -0,0 +1,294 @@
+// Compilation of XKB keymaps off the main loop
+
+#include "common.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <wayland-server-core.h>
+#include <wlr/util/log.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "qubes_keymap.h"
+
+/*
+ * Compiling a keymap takes tens of milliseconds, during which no input would
+ * be processed if it was done on the main loop.  A single worker thread does
+ * it instead.  libxkbcommon objects are not thread-safe, so the worker uses a
+ * fresh xkb_context for each keymap and never touches a keymap again once it
+ * is handed to the main thread.  The worker touches nothing else, so wlroots
+ * and libwayland still only ever run on the main thread.
+ */
+
+enum {
+	/* Compiled keymaps kept around, so switching back is instant */
+	QUBES_KEYMAP_CACHE_SIZE = 8,
+};
+
+struct qubes_keymap_cache_entry {
+	char *layout;              /**< qubesdb layout string, or NULL if unused */
+	struct xkb_keymap *keymap; /**< Owned reference */
+	uint64_t last_used;        /**< For LRU eviction */
+};
+
+struct qubes_keymap_compiler {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* Protected by lock */
+	char *job;                      /**< Layout to compile next, or NULL */
+	char *done_layout;              /**< Layout of the finished job */
+	struct xkb_keymap *done_keymap; /**< Result of the finished job */
+	bool has_result;                /**< done_* are valid */
+	bool stop;                      /**< Worker must exit */
+
+	/* Main thread only */
+	int eventfd;                    /**< Written by the worker when done */
+	struct wl_event_source *source; /**< Event source for eventfd */
+	char *wanted;                   /**< Most recently requested layout */
+	qubes_keymap_callback callback;
+	void *data;
+	uint64_t clock;
+	struct qubes_keymap_cache_entry cache[QUBES_KEYMAP_CACHE_SIZE];
+};
+
+static struct xkb_keymap *qubes_keymap_compile(const char *layout)
+{
+	struct xkb_rule_names names = { 0 };
+	char *copy = strdup(layout);
+	if (!copy)
+		return NULL;
+	names.layout = copy;
+	char *end_layout = strchr(copy, '+');
+	if (end_layout) {
+		*end_layout++ = 0;
+		names.variant = end_layout;
+		end_layout = strchr(end_layout, '+');
+		if (end_layout) {
+			*end_layout++ = 0;
+			// use NULL for defaults rather than disabling all options
+			if (*end_layout)
+				names.options = end_layout;
+		}
+	}
+	struct xkb_keymap *keymap = NULL;
+	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	if (context) {
+		keymap = xkb_keymap_new_from_names(context, &names,
+		                                   XKB_KEYMAP_COMPILE_NO_FLAGS);
+		/* The keymap holds its own reference */
+		xkb_context_unref(context);
+	}
+	free(copy);
+	return keymap;
+}
+
+static void *qubes_keymap_worker(void *raw_compiler)
+{
+	struct qubes_keymap_compiler *compiler = raw_compiler;
+	assert(pthread_mutex_lock(&compiler->lock) == 0);
+	while (!compiler->stop) {
+		if (!compiler->job) {
+			assert(pthread_cond_wait(&compiler->cond, &compiler->lock) == 0);
+			continue;
+		}
+		char *layout = compiler->job;
+		compiler->job = NULL;
+		assert(pthread_mutex_unlock(&compiler->lock) == 0);
+
+		struct xkb_keymap *keymap = qubes_keymap_compile(layout);
+
+		assert(pthread_mutex_lock(&compiler->lock) == 0);
+		if (compiler->has_result) {
+			/* Not picked up yet, and superseded */
+			free(compiler->done_layout);
+			xkb_keymap_unref(compiler->done_keymap);
+		}
+		compiler->done_layout = layout;
+		compiler->done_keymap = keymap;
+		compiler->has_result = true;
+		uint64_t one = 1;
+		assert(write(compiler->eventfd, &one, sizeof one) == sizeof one);
+	}
+	assert(pthread_mutex_unlock(&compiler->lock) == 0);
+	return NULL;
+}
+
+static struct qubes_keymap_cache_entry *
+qubes_keymap_cache_find(struct qubes_keymap_compiler *compiler,
+                        const char *layout)
+{
+	for (int i = 0; i < QUBES_KEYMAP_CACHE_SIZE; ++i) {
+		struct qubes_keymap_cache_entry *entry = compiler->cache + i;
+		if (entry->layout && !strcmp(entry->layout, layout)) {
+			entry->last_used = ++compiler->clock;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Takes ownership of layout and keymap */
+static struct qubes_keymap_cache_entry *
+qubes_keymap_cache_insert(struct qubes_keymap_compiler *compiler,
+                          char *layout, struct xkb_keymap *keymap)
+{
+	struct qubes_keymap_cache_entry *victim = compiler->cache;
+	for (int i = 1; i < QUBES_KEYMAP_CACHE_SIZE; ++i) {
+		if (!victim->layout)
+			break;
+		if (!compiler->cache[i].layout ||
+		    compiler->cache[i].last_used < victim->last_used)
+			victim = compiler->cache + i;
+	}
+	if (victim->layout) {
+		free(victim->layout);
+		xkb_keymap_unref(victim->keymap);
+	}
+	victim->layout = layout;
+	victim->keymap = keymap;
+	victim->last_used = ++compiler->clock;
+	return victim;
+}
+
+static int qubes_keymap_on_done(int fd, uint32_t mask, void *data)
+{
+	struct qubes_keymap_compiler *compiler = data;
+	uint64_t count;
+	assert(fd == compiler->eventfd);
+	if (read(fd, &count, sizeof count) != sizeof count) {
+		assert(errno == EAGAIN || errno == EWOULDBLOCK);
+		return 0;
+	}
+
+	assert(pthread_mutex_lock(&compiler->lock) == 0);
+	bool const has_result = compiler->has_result;
+	char *layout = compiler->done_layout;
+	struct xkb_keymap *keymap = compiler->done_keymap;
+	compiler->has_result = false;
+	compiler->done_layout = NULL;
+	compiler->done_keymap = NULL;
+	assert(pthread_mutex_unlock(&compiler->lock) == 0);
+	if (!has_result)
+		return 0;
+
+	bool const wanted = compiler->wanted && !strcmp(compiler->wanted, layout);
+	if (!keymap) {
+		if (wanted)
+			compiler->callback(compiler->data, layout, NULL);
+		free(layout);
+		return 0;
+	}
+	struct qubes_keymap_cache_entry *entry =
+	   qubes_keymap_cache_insert(compiler, layout, keymap);
+	if (wanted)
+		compiler->callback(compiler->data, entry->layout, entry->keymap);
+	return 0;
+}
+
+bool qubes_keymap_compiler_request(struct qubes_keymap_compiler *compiler,
+                                   const char *layout)
+{
+	char *wanted = strdup(layout), *job = strdup(layout);
+	if (!wanted || !job) {
+		free(wanted);
+		free(job);
+		return false;
+	}
+	free(compiler->wanted);
+	compiler->wanted = wanted;
+
+	struct qubes_keymap_cache_entry *entry =
+	   qubes_keymap_cache_find(compiler, layout);
+	if (entry) {
+		free(job);
+		wlr_log(WLR_DEBUG, "Using cached keymap for layout %s", layout);
+		compiler->callback(compiler->data, entry->layout, entry->keymap);
+		return true;
+	}
+
+	assert(pthread_mutex_lock(&compiler->lock) == 0);
+	free(compiler->job); /* superseded before the worker got to it */
+	compiler->job = job;
+	assert(pthread_cond_signal(&compiler->cond) == 0);
+	assert(pthread_mutex_unlock(&compiler->lock) == 0);
+	return true;
+}
+
+struct qubes_keymap_compiler *
+qubes_keymap_compiler_create(struct wl_event_loop *loop,
+                             qubes_keymap_callback callback, void *data)
+{
+	struct qubes_keymap_compiler *compiler = calloc(sizeof(*compiler), 1);
+	if (!compiler)
+		return NULL;
+	compiler->callback = callback;
+	compiler->data = data;
+	compiler->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (compiler->eventfd == -1)
+		goto free_compiler;
+	compiler->source = wl_event_loop_add_fd(loop, compiler->eventfd,
+	                                        WL_EVENT_READABLE,
+	                                        qubes_keymap_on_done, compiler);
+	if (!compiler->source)
+		goto close_fd;
+	assert(pthread_mutex_init(&compiler->lock, NULL) == 0);
+	assert(pthread_cond_init(&compiler->cond, NULL) == 0);
+
+	/* Signals must keep going to the main thread's signalfd */
+	sigset_t all, old;
+	assert(sigfillset(&all) == 0);
+	assert(pthread_sigmask(SIG_SETMASK, &all, &old) == 0);
+	int const res =
+	   pthread_create(&compiler->thread, NULL, qubes_keymap_worker, compiler);
+	assert(pthread_sigmask(SIG_SETMASK, &old, NULL) == 0);
+	if (res) {
+		wlr_log(WLR_ERROR, "Cannot create keymap thread: %s", strerror(res));
+		goto destroy_sync;
+	}
+	return compiler;
+destroy_sync:
+	assert(pthread_cond_destroy(&compiler->cond) == 0);
+	assert(pthread_mutex_destroy(&compiler->lock) == 0);
+	wl_event_source_remove(compiler->source);
+close_fd:
+	assert(close(compiler->eventfd) == 0);
+free_compiler:
+	free(compiler);
+	return NULL;
+}
+
+void qubes_keymap_compiler_destroy(struct qubes_keymap_compiler *compiler)
+{
+	if (!compiler)
+		return;
+	assert(pthread_mutex_lock(&compiler->lock) == 0);
+	compiler->stop = true;
+	assert(pthread_cond_signal(&compiler->cond) == 0);
+	assert(pthread_mutex_unlock(&compiler->lock) == 0);
+	assert(pthread_join(compiler->thread, NULL) == 0);
+
+	free(compiler->job);
+	if (compiler->has_result) {
+		free(compiler->done_layout);
+		xkb_keymap_unref(compiler->done_keymap);
+	}
+	for (int i = 0; i < QUBES_KEYMAP_CACHE_SIZE; ++i) {
+		free(compiler->cache[i].layout);
+		xkb_keymap_unref(compiler->cache[i].keymap);
+	}
+	free(compiler->wanted);
+	wl_event_source_remove(compiler->source);
+	assert(close(compiler->eventfd) == 0);
+	assert(pthread_cond_destroy(&compiler->cond) == 0);
+	assert(pthread_mutex_destroy(&compiler->lock) == 0);
+	free(compiler);
+}
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -0,0 +1,42 @@
+#ifndef QUBES_WAYLAND_COMPOSITOR_KEYMAP_H
+#define QUBES_WAYLAND_COMPOSITOR_KEYMAP_H                                      \
+	_Pragma("GCC error \"double-include guard referenced\"")
+#include "common.h"
+
+#include <wayland-server-core.h>
+#include <xkbcommon/xkbcommon.h>
+
+struct qubes_keymap_compiler;
+
+/**
+ * Called on the main thread with the keymap for the most recently requested
+ * layout, or with NULL if it cannot be compiled.  The keymap is only borrowed.
+ */
+typedef void (*qubes_keymap_callback)(void *data, const char *layout,
+                                      struct xkb_keymap *keymap);
+
+/**
+ * Creates a compiler that turns qubesdb layout strings ("layout+variant+options")
+ * into keymaps on a worker thread.  Owned by main().
+ */
+struct qubes_keymap_compiler *
+qubes_keymap_compiler_create(struct wl_event_loop *loop,
+                             qubes_keymap_callback callback, void *data);
+
+/**
+ * Ask for the keymap for a layout.  If it is cached, the callback runs before
+ * this returns.  Otherwise it runs once the worker is done, unless another
+ * layout has been requested in the meantime.  Returns false on allocation
+ * failure.
+ */
+bool qubes_keymap_compiler_request(struct qubes_keymap_compiler *compiler,
+                                   const char *layout)
+   __attribute__((warn_unused_result));
+
+/**
+ * Stops the worker thread and frees all cached keymaps.
+ */
+void qubes_keymap_compiler_destroy(struct qubes_keymap_compiler *compiler);
+
+#endif
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -5,15 +5,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <wayland-server-core.h>
 
 #include <wlr/interfaces/wlr_keyboard.h>
 #include <wlr/render/drm_format_set.h>
+#include <wlr/types/wlr_compositor.h>
+#include <wlr/types/wlr_damage_ring.h>
 #include <wlr/types/wlr_data_device.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_seat.h>
+#include <wlr/types/wlr_subcompositor.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/util/log.h>
 
@@ -21,6 +25,7 @@
 #include "qubes_allocator.h"
 #include "qubes_backend.h"
 #include "qubes_output.h"
+#include "qubes_trace.h"
 #include "qubes_wayland.h"
 #include "qubes_xwayland.h"
 #include <drm_fourcc.h>
@@ -58,6 +63,50 @@ static void qubes_output_deinit_raw(struct wlr_output *raw_output)
 	qubes_unlink_buffer(output);
 }
 
+/*
+ * Should a buffer that did come from the Qubes allocator be copied anyway?
+ * Showing a new buffer means a MSG_WINDOW_DUMP carrying every grant ref of
+ * the buffer, and the daemon mapping all of them again.  Rendering switches
+ * buffers on every frame, as wlroots cycles through its swapchain.  For a big
+ * window it is much cheaper to copy the damage into a buffer the daemon has
+ * already mapped, which is what qubes_output_scan_out() does, so later frames
+ * only send MSG_SHMIMAGE.
+ */
+static bool qubes_output_wants_stable_buffer(struct qubes_output *output,
+                                             struct wlr_buffer *buffer)
+{
+	size_t const limit = output->server->stable_buffer_bytes;
+	return limit &&
+	       (size_t)buffer->width * (size_t)buffer->height * 4 >= limit;
+}
+
+/*
+ * Can a buffer that did not come from the Qubes allocator be shown directly?
+ * wlr_scene offers the client's buffer when it is the only thing visible and
+ * covers the whole output.  Such a buffer lives in client memory, which
+ * cannot be granted to the GUI daemon, so it is copied into a grant buffer
+ * owned by the output instead.  That skips composition, and only the damaged
+ * part of the buffer is copied.  wlr_scene does not pass damage along with
+ * such a buffer, so it is taken from the scene output, which is only known
+ * while qubes_output_frame() commits it.
+ */
+static bool qubes_output_can_scan_out(struct qubes_output *output,
+                                      struct wlr_buffer *buffer)
+{
+	void *data;
+	uint32_t format;
+	size_t stride;
+	if ((uint32_t)buffer->width != output->guest.width ||
+	    (uint32_t)buffer->height != output->guest.height)
+		return false;
+	if (!wlr_buffer_begin_data_ptr_access(
+	       buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ, &data, &format, &stride))
+		return false;
+	wlr_buffer_end_data_ptr_access(buffer);
+	return (format == DRM_FORMAT_XRGB8888 || format == DRM_FORMAT_ARGB8888) &&
+	       stride >= (size_t)buffer->width * 4;
+}
+
 static bool qubes_output_test(struct wlr_output *raw_output,
                               const struct wlr_output_state *state)
 {
@@ -65,25 +114,304 @@ static bool qubes_output_test(struct wlr_output *raw_output,
 	struct qubes_output *output = wl_container_of(raw_output, output, output);
 	if ((state->committed & WLR_OUTPUT_STATE_BUFFER) &&
 	    (state->buffer != NULL) &&
-	    (state->buffer->impl != qubes_buffer_impl_addr))
+	    (state->buffer->impl != qubes_buffer_impl_addr) &&
+	    ((!(state->committed & WLR_OUTPUT_STATE_DAMAGE) &&
+	      !output->frame_damage) ||
+	     !qubes_output_can_scan_out(output, state->buffer)))
+		return false;
+	return true;
+}
+
+static uint64_t qubes_monotonic_us(void)
+{
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/* Send a message about this output, accounting for it in output->stats */
+static void qubes_output_send(struct qubes_output *output,
+                              struct msg_hdr *header)
+{
+	output->stats.messages++;
+	output->stats.bytes += sizeof(*header) + header->untrusted_len;
+	QUBES_TRACE(send, header->window, header->type, header->untrusted_len);
+	qubes_rust_send_message(output->server->backend->rust_backend, header);
+}
+
+enum {
+	/* Side of the tiles compared by qubes_output_diff_damage() */
+	QUBES_DIFF_TILE = 64,
+	/* Windows smaller than this are not worth diffing */
+	QUBES_DIFF_MIN_PIXELS = 256 * 256,
+	/* Windows whose budget drops below this stop diffing for a while */
+	QUBES_DIFF_MIN_BUDGET = QUBES_DIFF_TILE * QUBES_DIFF_TILE,
+	/* Frames a window that gave up on diffing waits before it tries again */
+	QUBES_DIFF_BACKOFF_FRAMES = 256,
+	/* Cost of sending one MSG_SHMIMAGE, expressed in pixels copied */
+	QUBES_DAMAGE_MESSAGE_COST = 4096,
+	/* Maximum number of MSG_SHMIMAGE messages per frame */
+	QUBES_DAMAGE_MAX_RECTS = 16,
+	/* Past this many rectangles, do not bother coalescing */
+	QUBES_DAMAGE_MAX_INPUT_RECTS = 1024,
+};
+
+static int64_t qubes_box_area(const pixman_box32_t *box)
+{
+	return (int64_t)(box->x2 - box->x1) * (int64_t)(box->y2 - box->y1);
+}
+
+/*
+ * Number of pixels that would be copied needlessly if a and b were sent as
+ * their bounding box instead of separately.
+ */
+static int64_t qubes_merge_cost(const pixman_box32_t *a,
+                                const pixman_box32_t *b)
+{
+	pixman_box32_t const bbox = {
+		.x1 = QUBES_MIN(a->x1, b->x1),
+		.y1 = QUBES_MIN(a->y1, b->y1),
+		.x2 = QUBES_MAX(a->x2, b->x2),
+		.y2 = QUBES_MAX(a->y2, b->y2),
+	};
+	pixman_box32_t const overlap = {
+		.x1 = QUBES_MAX(a->x1, b->x1),
+		.y1 = QUBES_MAX(a->y1, b->y1),
+		.x2 = QUBES_MIN(a->x2, b->x2),
+		.y2 = QUBES_MIN(a->y2, b->y2),
+	};
+	int64_t cost = qubes_box_area(&bbox) - qubes_box_area(a) - qubes_box_area(b);
+	if (overlap.x1 < overlap.x2 && overlap.y1 < overlap.y2)
+		cost += qubes_box_area(&overlap);
+	return cost;
+}
+
+/*
+ * Merge damage rectangles whenever copying the extra pixels is cheaper than
+ * sending another message, and never produce more than max_out rectangles.
+ * Returns the number of rectangles written to out, or -1 if the whole window
+ * should be sent instead.
+ */
+static int qubes_coalesce_damage(const pixman_box32_t *in, int n_in,
+                                 pixman_box32_t *out, int max_out,
+                                 int64_t window_area)
+{
+	int n_out = 0;
+	int64_t area = 0;
+	if (n_in > QUBES_DAMAGE_MAX_INPUT_RECTS)
+		return -1;
+	for (int i = 0; i < n_in; ++i) {
+		if (in[i].x2 <= in[i].x1 || in[i].y2 <= in[i].y1)
+			continue;
+		int best = -1;
+		int64_t best_cost = INT64_MAX;
+		for (int j = 0; j < n_out; ++j) {
+			int64_t const cost = qubes_merge_cost(out + j, in + i);
+			if (cost < best_cost) {
+				best = j;
+				best_cost = cost;
+			}
+		}
+		if (best == -1 ||
+		    (best_cost > QUBES_DAMAGE_MESSAGE_COST && n_out < max_out)) {
+			out[n_out++] = in[i];
+			continue;
+		}
+		out[best].x1 = QUBES_MIN(out[best].x1, in[i].x1);
+		out[best].y1 = QUBES_MIN(out[best].y1, in[i].y1);
+		out[best].x2 = QUBES_MAX(out[best].x2, in[i].x2);
+		out[best].y2 = QUBES_MAX(out[best].y2, in[i].y2);
+	}
+	for (int i = 0; i < n_out; ++i)
+		area += qubes_box_area(out + i);
+	/* Sending most of the window piecewise is slower than sending it whole */
+	if (area * 4 >= window_area * 3)
+		return -1;
+	return n_out;
+}
+
+static void qubes_copy_box(uint8_t *dst, size_t dst_stride, const uint8_t *src,
+                           size_t src_stride, pixman_box32_t box,
+                           int32_t width, int32_t height)
+{
+	box.x1 = QUBES_MAX(box.x1, 0);
+	box.y1 = QUBES_MAX(box.y1, 0);
+	box.x2 = QUBES_MIN(box.x2, width);
+	box.y2 = QUBES_MIN(box.y2, height);
+	if (box.x1 >= box.x2)
+		return;
+	size_t const offset = (size_t)box.x1 * 4;
+	size_t const len = (size_t)(box.x2 - box.x1) * 4;
+	for (int32_t y = box.y1; y < box.y2; ++y)
+		memcpy(dst + (size_t)y * dst_stride + offset,
+		       src + (size_t)y * src_stride + offset, len);
+}
+
+static bool qubes_append_box(pixman_box32_t *out, int *n_out, int max_out,
+                             pixman_box32_t box)
+{
+	if (*n_out >= max_out)
 		return false;
+	out[(*n_out)++] = box;
 	return true;
 }
 
+/*
+ * Drop the parts of the damage that did not really change, by comparing the
+ * buffer with a shadow copy of what the daemon was last sent, one tile at a
+ * time.  Rows are compared with memcmp(), for which the C library already
+ * picks an SSE2, AVX2 or NEON implementation at runtime.  The shadow is
+ * updated as a side effect.  Returns the number of changed boxes in out, or
+ * -1 if the damage must be sent as is.
+ *
+ * Each window has its own budget, capped by the server's.  It grows while
+ * the comparison finds little change and shrinks while almost everything
+ * changed, as in videos and games.  Once it is too small to be of use, the
+ * shadow is freed and the window stops diffing for a while.
+ */
+static int qubes_output_diff_damage(struct qubes_output *output,
+                                    const pixman_box32_t *rects, int n_rects,
+                                    bool resync, pixman_box32_t *out,
+                                    int max_out)
+{
+	struct wlr_buffer *buffer = output->buffer;
+	void *data;
+	uint32_t format;
+	size_t stride;
+	if (!buffer ||
+	    !wlr_buffer_begin_data_ptr_access(
+	       buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ, &data, &format, &stride))
+		return -1;
+	int32_t const width = buffer->width, height = buffer->height;
+	size_t const shadow_stride = (size_t)width * 4;
+	size_t const bytes = shadow_stride * (size_t)height;
+	if (output->shadow.width != width || output->shadow.height != height) {
+		free(output->shadow.pixels);
+		output->shadow.pixels = NULL;
+		output->shadow.width = output->shadow.height = 0;
+		/* Small windows are cheap to send, and big ones may not fit */
+		if ((uint64_t)width * (uint64_t)height < QUBES_DIFF_MIN_PIXELS ||
+		    bytes > output->server->diff.shadow_limit ||
+		    !(output->shadow.pixels = malloc(bytes))) {
+			wlr_buffer_end_data_ptr_access(buffer);
+			return -1;
+		}
+		output->shadow.width = width;
+		output->shadow.height = height;
+		output->shadow.budget = output->server->diff.pixel_budget;
+		resync = true;
+	}
+
+	uint8_t *const shadow = output->shadow.pixels;
+	pixman_box32_t const all = { 0, 0, width, height };
+	if (resync) {
+		qubes_copy_box(shadow, shadow_stride, data, stride, all, width, height);
+		wlr_buffer_end_data_ptr_access(buffer);
+		return -1;
+	}
+
+	uint64_t budget = output->shadow.budget;
+	int n_out = 0;
+	bool overflow = false;
+	for (int i = 0; i < n_rects; ++i) {
+		pixman_box32_t const r = {
+			.x1 = QUBES_MAX(rects[i].x1, 0),
+			.y1 = QUBES_MAX(rects[i].y1, 0),
+			.x2 = QUBES_MIN(rects[i].x2, width),
+			.y2 = QUBES_MIN(rects[i].y2, height),
+		};
+		if (r.x1 >= r.x2 || r.y1 >= r.y2)
+			continue;
+		uint64_t const area = (uint64_t)qubes_box_area(&r);
+		if (area > budget) {
+			/* Out of CPU budget: send the rest without looking at it */
+			qubes_copy_box(shadow, shadow_stride, data, stride, r, width,
+			               height);
+			overflow |= !qubes_append_box(out, &n_out, max_out, r);
+			budget = 0;
+			continue;
+		}
+		budget -= area;
+		for (int32_t ty = r.y1 - r.y1 % QUBES_DIFF_TILE; ty < r.y2;
+		     ty += QUBES_DIFF_TILE) {
+			pixman_box32_t run = { 0, 0, 0, 0 };
+			int32_t const y1 = QUBES_MAX(ty, r.y1);
+			int32_t const y2 = QUBES_MIN(ty + QUBES_DIFF_TILE, r.y2);
+			for (int32_t tx = r.x1 - r.x1 % QUBES_DIFF_TILE; tx < r.x2;
+			     tx += QUBES_DIFF_TILE) {
+				int32_t const x1 = QUBES_MAX(tx, r.x1);
+				int32_t const x2 = QUBES_MIN(tx + QUBES_DIFF_TILE, r.x2);
+				size_t const offset = (size_t)x1 * 4;
+				size_t const len = (size_t)(x2 - x1) * 4;
+				bool changed = false;
+				for (int32_t y = y1; y < y2; ++y) {
+					uint8_t *const dst = shadow + (size_t)y * shadow_stride + offset;
+					const uint8_t *const src =
+					   (const uint8_t *)data + (size_t)y * stride + offset;
+					if (memcmp(dst, src, len)) {
+						memcpy(dst, src, len);
+						changed = true;
+					}
+				}
+				if (!changed)
+					continue;
+				/* Merge horizontally adjacent changed tiles */
+				if (run.x2 == x1 && run.x1 < run.x2) {
+					run.x2 = x2;
+					continue;
+				}
+				if (run.x1 < run.x2)
+					overflow |= !qubes_append_box(out, &n_out, max_out, run);
+				run = (pixman_box32_t){ x1, y1, x2, y2 };
+			}
+			if (run.x1 < run.x2)
+				overflow |= !qubes_append_box(out, &n_out, max_out, run);
+		}
+	}
+	wlr_buffer_end_data_ptr_access(buffer);
+	if (overflow)
+		return -1;
+	uint64_t changed = 0;
+	for (int i = 0; i < n_out; ++i)
+		changed += (uint64_t)qubes_box_area(out + i);
+	uint64_t const compared = output->shadow.budget - budget;
+	output->stats.diff_pixels_compared += compared;
+	output->stats.diff_pixels_sent += changed;
+	if (changed * 4 < compared) {
+		output->shadow.budget = QUBES_MIN(output->shadow.budget * 2,
+		                                  output->server->diff.pixel_budget);
+	} else if (changed * 4 > compared * 3) {
+		output->shadow.budget /= 2;
+		if (output->shadow.budget < QUBES_DIFF_MIN_BUDGET) {
+			free(output->shadow.pixels);
+			output->shadow.pixels = NULL;
+			output->shadow.width = output->shadow.height = 0;
+			output->shadow.backoff = QUBES_DIFF_BACKOFF_FRAMES;
+		}
+	}
+	return n_out;
+}
+
 static void qubes_output_damage(struct qubes_output *output,
                                 const struct wlr_output_state *state)
 {
 	pixman_box32_t fake_rect = {
 		.x1 = 0, .y1 = 0, .x2 = output->guest.width, .y2 = output->guest.height
 	};
+	pixman_box32_t coalesced[QUBES_DAMAGE_MAX_RECTS];
+	pixman_box32_t diffed[QUBES_DAMAGE_MAX_INPUT_RECTS];
 	pixman_box32_t *rects;
 	int n_rects;
+	bool resync = false;
 	if (state == NULL || (output->flags & QUBES_OUTPUT_DAMAGE_ALL) ||
 		 (state->committed & WLR_OUTPUT_STATE_MODE) ||
 		 (output->magic != QUBES_VIEW_MAGIC)) {
 		wlr_log(WLR_DEBUG, "Damaging everything");
 		n_rects = 1;
 		rects = &fake_rect;
+		/* In these cases the daemon must get the whole window */
+		resync = state == NULL || (output->flags & QUBES_OUTPUT_DAMAGE_ALL) ||
+		         (state->committed & WLR_OUTPUT_STATE_MODE);
 		output->flags &= ~QUBES_OUTPUT_DAMAGE_ALL;
 	} else if (!(state->committed & WLR_OUTPUT_STATE_DAMAGE)) {
 		return;
@@ -96,6 +424,31 @@ static void qubes_output_damage(struct qubes_output *output,
 			return;
 		}
 	}
+	if (output->shadow.backoff) {
+		output->shadow.backoff--;
+	} else if (output->server->diff.shadow_limit) {
+		int const n_diffed = qubes_output_diff_damage(
+		   output, rects, n_rects, resync, diffed, QUBES_DAMAGE_MAX_INPUT_RECTS);
+		if (n_diffed == 0) {
+			wlr_log(WLR_DEBUG, "Damaged region did not change");
+			return;
+		}
+		if (n_diffed > 0) {
+			rects = diffed;
+			n_rects = n_diffed;
+		}
+	}
+	if (rects != &fake_rect) {
+		n_rects = qubes_coalesce_damage(
+		   rects, n_rects, coalesced, QUBES_DAMAGE_MAX_RECTS,
+		   qubes_box_area(&fake_rect));
+		if (n_rects < 0) {
+			n_rects = 1;
+			rects = &fake_rect;
+		} else {
+			rects = coalesced;
+		}
+	}
 	for (int i = 0; i < n_rects; ++i) {
 		int32_t width, height;
 		if (__builtin_sub_overflow(rects[i].x2, rects[i].x1, &width) ||
@@ -127,9 +480,118 @@ static void qubes_output_damage(struct qubes_output *output,
 		// clang-format on
 		QUBES_STATIC_ASSERT(sizeof new_msg ==
 		                    sizeof new_msg.header + sizeof new_msg.shmimage);
+		output->stats.shmimages++;
+		output->stats.damage_pixels += (uint64_t)width * (uint64_t)height;
+		QUBES_TRACE(damage, output->window_id, rects[i].x1, rects[i].y1, width,
+		            height);
 		// Created above
-		qubes_rust_send_message(output->server->backend->rust_backend,
-		                        (struct msg_hdr *)&new_msg);
+		qubes_output_send(output, (struct msg_hdr *)&new_msg);
+	}
+}
+
+static void qubes_output_release_frame(struct qubes_output *output);
+
+/* Append a dump to the ring, growing it if it is full */
+static bool qubes_dump_ring_push(struct qubes_dump_ring *ring,
+                                 struct qubes_dump dump)
+{
+	if (ring->len == ring->capacity) {
+		uint32_t const capacity = ring->capacity ? ring->capacity * 2 : 64;
+		struct qubes_dump *dumps;
+		if (capacity <= ring->capacity ||
+		    !(dumps = calloc(capacity, sizeof(*dumps)))) {
+			wlr_log(WLR_ERROR, "Cannot grow dump ring to %" PRIu32 " entries",
+			        capacity);
+			return false;
+		}
+		/* Unwrap the old contents to the start of the new array */
+		for (uint32_t i = 0; i < ring->len; ++i)
+			dumps[i] = ring->dumps[(ring->head + i) & (ring->capacity - 1)];
+		free(ring->dumps);
+		ring->dumps = dumps;
+		ring->capacity = capacity;
+		ring->head = 0;
+	}
+	ring->dumps[(ring->head + ring->len) & (ring->capacity - 1)] = dump;
+	ring->len++;
+	return true;
+}
+
+void qubes_dump_ring_release(struct qubes_dump_ring *ring)
+{
+	for (; ring->len; ring->len--) {
+		struct qubes_dump *dump = ring->dumps + ring->head;
+		ring->head = (ring->head + 1) & (ring->capacity - 1);
+		if (dump->output) {
+			assert(dump->output->dumps_in_flight > 0);
+			dump->output->dumps_in_flight--;
+			dump->output->flags &= ~QUBES_OUTPUT_DUMP_HELD;
+			if (dump->output->flags & QUBES_OUTPUT_FRAME_THROTTLED) {
+				/* The ACK will never come, so do not wait for it */
+				dump->output->flags &= ~QUBES_OUTPUT_FRAME_THROTTLED;
+				dump->output->flags |= QUBES_OUTPUT_FRAME_SCHEDULED;
+				wl_event_source_timer_update(dump->output->frame_timer, 1);
+			}
+		}
+		qubes_buffer_destroy(&dump->buffer->inner);
+	}
+	ring->head = 0;
+}
+
+/* Forget about an output that is going away, keeping its dumps in the ring */
+static void qubes_dump_ring_forget(struct qubes_dump_ring *ring,
+                                   struct qubes_output *output)
+{
+	for (uint32_t i = 0; i < ring->len; ++i) {
+		struct qubes_dump *dump =
+		   ring->dumps + ((ring->head + i) & (ring->capacity - 1));
+		if (dump->output == output)
+			dump->output = NULL;
+	}
+	output->dumps_in_flight = 0;
+}
+
+void qubes_output_dump_acked(struct tinywl_server *server, uint32_t window_id)
+{
+	struct qubes_dump_ring *ring = &server->dumps;
+	if (ring->len == 0) {
+		wlr_log(WLR_ERROR, "Daemon sent too many MSG_WINDOW_DUMP_ACK messages");
+		return;
+	}
+	struct qubes_dump dump = ring->dumps[ring->head];
+	ring->head = (ring->head + 1) & (ring->capacity - 1);
+	ring->len--;
+	uint64_t const latency = qubes_monotonic_us() - dump.sent_us;
+	QUBES_TRACE(dump_ack, window_id, latency);
+	if (dump.window_id != window_id)
+		wlr_log(WLR_ERROR,
+		        "MSG_WINDOW_DUMP_ACK for window %" PRIu32
+		        " but oldest dump is for window %" PRIu32,
+		        window_id, dump.window_id);
+	qubes_buffer_destroy(&dump.buffer->inner);
+	if (!dump.output)
+		return;
+	assert(dump.output->dumps_in_flight > 0);
+	dump.output->dumps_in_flight--;
+	dump.output->stats.acks++;
+	dump.output->stats.ack_us_total += latency;
+	dump.output->stats.ack_us_max =
+	   QUBES_MAX(dump.output->stats.ack_us_max, latency);
+	dump.output->pacing.ack_us =
+	   dump.output->pacing.ack_us
+	      ? (dump.output->pacing.ack_us * 7 + latency) / 8
+	      : latency;
+	if ((dump.output->flags & QUBES_OUTPUT_DUMP_HELD) && dump.output->buffer &&
+	    qubes_output_created(dump.output)) {
+		/* The held dump replaces any damage that was not sent */
+		dump.output->flags &= ~QUBES_OUTPUT_DUMP_HELD;
+		qubes_output_dump_buffer(dump.output, NULL);
+	}
+	if ((dump.output->flags & QUBES_OUTPUT_FRAME_THROTTLED) &&
+	    dump.output->dumps_in_flight == 0) {
+		/* The daemon caught up, so the client may draw again */
+		dump.output->flags &= ~QUBES_OUTPUT_FRAME_THROTTLED;
+		qubes_output_release_frame(dump.output);
 	}
 }
 
@@ -140,31 +602,40 @@ void qubes_output_dump_buffer(struct qubes_output *output,
 	struct tinywl_server *server = output->server;
 	struct qubes_buffer *buffer = wl_container_of(output->buffer, buffer, inner);
 	if (server->backend->protocol_version >= 0x10007) {
-		struct qubes_link *link = malloc(sizeof(*link));
-		if (link == NULL) {
-			wlr_log(WLR_ERROR, "Cannot allocate %zu bytes?", sizeof(*link));
-			abort(); /* FIXME */
+		/*
+		 * Each unacknowledged dump pins a buffer and its grants.  If the
+		 * daemon is not keeping up, send nothing until it acknowledges an
+		 * older dump, and then send the latest buffer in full.
+		 */
+		if (output->dumps_in_flight >= QUBES_MAX_DUMPS_IN_FLIGHT) {
+			output->flags |= QUBES_OUTPUT_DUMP_HELD;
+			output->stats.dumps_held++;
+			return;
+		}
+		struct qubes_dump dump = {
+			.buffer = buffer,
+			.output = output,
+			.sent_us = qubes_monotonic_us(),
+			.window_id = output->window_id,
+		};
+		if (!qubes_dump_ring_push(&server->dumps, dump)) {
+			/* Try again with the next buffer */
+			output->flags |= QUBES_OUTPUT_DUMP_HELD;
+			return;
 		}
 		assert(buffer->refcount != 0);
 		assert(buffer->refcount < INT32_MAX);
 		buffer->refcount++;
-		link->next = NULL;
-		link->buffer = buffer;
-		if (server->queue_tail) {
-			assert(server->queue_head != NULL);
-			server->queue_tail->next = link;
-		} else {
-			assert(server->queue_head == NULL);
-			server->queue_head = link;
-		}
-		output->server->queue_tail = link;
+		output->dumps_in_flight++;
 	}
+	output->stats.dumps++;
 	buffer->header.window = output->window_id;
 	buffer->header.type = MSG_WINDOW_DUMP;
 	buffer->header.untrusted_len =
 	   sizeof(buffer->qubes) + NUM_PAGES(buffer->size) * SIZEOF_GRANT_REF;
-	qubes_rust_send_message(output->server->backend->rust_backend,
-	                        &buffer->header);
+	QUBES_TRACE(dump, output->window_id, NUM_PAGES(buffer->size),
+	            output->dumps_in_flight);
+	qubes_output_send(output, &buffer->header);
 	qubes_output_damage(output, state);
 }
 
@@ -209,9 +680,112 @@ bool qubes_output_ensure_created(struct qubes_output *output)
 	// This is MSG_CREATE
 	wlr_log(WLR_DEBUG, "Sending MSG_CREATE (0x%x) to window %" PRIu32,
 	        MSG_CREATE, output->window_id);
-	qubes_rust_send_message(output->server->backend->rust_backend,
-	                        (struct msg_hdr *)&msg);
+	qubes_output_send(output, (struct msg_hdr *)&msg);
 	output->flags |= QUBES_OUTPUT_CREATED;
+	output->sent.valid = 0; /* a new window has no state in the daemon */
+	return true;
+}
+
+static const struct wlr_drm_format xrgb8888 = {
+	.format = DRM_FORMAT_XRGB8888,
+	.len = 2,
+	.capacity = 0,
+	.modifiers = { DRM_FORMAT_MOD_INVALID, DRM_FORMAT_MOD_LINEAR },
+};
+static const struct wlr_drm_format argb8888 = {
+	.format = DRM_FORMAT_ARGB8888,
+	.len = 2,
+	.capacity = 0,
+	.modifiers = { DRM_FORMAT_MOD_INVALID, DRM_FORMAT_MOD_LINEAR },
+};
+
+/* Make buffer the one shown by the daemon.  Returns false for NULL. */
+static bool qubes_output_attach_buffer(struct qubes_output *output,
+                                       struct wlr_buffer *buffer)
+{
+	if (output->buffer) {
+		wl_list_remove(&output->buffer_destroy.link);
+		wlr_buffer_unlock(output->buffer);
+	}
+
+	if (!(output->buffer = buffer))
+		return false;
+	wlr_buffer_lock(output->buffer);
+	wl_signal_add(&output->buffer->events.destroy, &output->buffer_destroy);
+	return true;
+}
+
+/* See qubes_output_can_scan_out() and qubes_output_wants_stable_buffer() */
+static bool qubes_output_scan_out(struct qubes_output *output,
+                                  const struct wlr_output_state *state)
+{
+	struct wlr_buffer *const src = state->buffer;
+	struct wlr_buffer *dst = output->scanout_buffer;
+	void *src_data, *dst_data;
+	uint32_t format, dst_format;
+	size_t src_stride, dst_stride;
+
+	if (!wlr_buffer_begin_data_ptr_access(src, WLR_BUFFER_DATA_PTR_ACCESS_READ,
+	                                      &src_data, &format, &src_stride))
+		return false;
+	if (dst) {
+		struct qubes_buffer *buffer = wl_container_of(dst, buffer, inner);
+		if (dst->width != src->width || dst->height != src->height ||
+		    buffer->format != format) {
+			wlr_buffer_drop(dst);
+			dst = output->scanout_buffer = NULL;
+		}
+	}
+	if (!dst) {
+		const struct wlr_drm_format *const drm_format =
+		   format == DRM_FORMAT_ARGB8888 ? &argb8888 : &xrgb8888;
+		dst = output->scanout_buffer = wlr_allocator_create_buffer(
+		   output->server->allocator, src->width, src->height, drm_format);
+		if (!dst) {
+			wlr_buffer_end_data_ptr_access(src);
+			return false;
+		}
+	}
+	assert(dst->impl == qubes_buffer_impl_addr);
+	assert(wlr_buffer_begin_data_ptr_access(
+	   dst, WLR_BUFFER_DATA_PTR_ACCESS_WRITE, &dst_data, &dst_format,
+	   &dst_stride));
+
+	/*
+	 * Direct scanout commits from wlr_scene carry no damage, so use that of
+	 * the scene output.  See qubes_output_frame().
+	 */
+	struct wlr_output_state damaged = *state;
+	if (!(state->committed & WLR_OUTPUT_STATE_DAMAGE) && output->frame_damage) {
+		/* Only read, so the region need not be copied */
+		damaged.committed |= WLR_OUTPUT_STATE_DAMAGE;
+		damaged.damage = *output->frame_damage;
+		output->flags |= QUBES_OUTPUT_SCANOUT_DAMAGE_USED;
+	}
+	/* A buffer the daemon has not seen yet must be filled completely */
+	bool const full = output->buffer != dst ||
+	                  !(damaged.committed & WLR_OUTPUT_STATE_DAMAGE);
+	if (full) {
+		pixman_box32_t const box = { 0, 0, src->width, src->height };
+		qubes_copy_box(dst_data, dst_stride, src_data, src_stride, box,
+		               src->width, src->height);
+	} else {
+		int n_rects = 0;
+		const pixman_box32_t *rects =
+		   pixman_region32_rectangles(&damaged.damage, &n_rects);
+		for (int i = 0; i < n_rects; ++i)
+			qubes_copy_box(dst_data, dst_stride, src_data, src_stride, rects[i],
+			               src->width, src->height);
+	}
+	wlr_buffer_end_data_ptr_access(dst);
+	wlr_buffer_end_data_ptr_access(src);
+
+	if (output->buffer != dst) {
+		qubes_output_attach_buffer(output, dst);
+		qubes_output_dump_buffer(output, NULL);
+	} else {
+		qubes_output_damage(output, full ? NULL : &damaged);
+	}
 	return true;
 }
 
@@ -224,6 +798,7 @@ static bool qubes_output_commit(struct wlr_output *raw_output,
 	if (!qubes_output_ensure_created(output))
 		return false;
 
+	output->stats.commits++;
 	if (state->committed & WLR_OUTPUT_STATE_MODE) {
 		assert(state->mode_type == WLR_OUTPUT_STATE_MODE_CUSTOM);
 		assert(state->custom_mode.width > 0);
@@ -234,44 +809,28 @@ static bool qubes_output_commit(struct wlr_output *raw_output,
 		if ((uint32_t)state->custom_mode.height != output->guest.height)
 			wlr_log(WLR_ERROR, "BUG: size mismatch: %d vs %" PRIu32,
 			        state->custom_mode.height, output->guest.height);
+		if (state->custom_mode.refresh > 0)
+			output->refresh = state->custom_mode.refresh;
 		wlr_output_update_custom_mode(raw_output, output->guest.width,
-		                              output->guest.height,
-		                              state->custom_mode.refresh);
+		                              output->guest.height, output->refresh);
 		qubes_send_configure(output);
 	}
 
-	if ((state->committed & WLR_OUTPUT_STATE_BUFFER) &&
-	    (output->buffer != state->buffer)) {
-		if (output->buffer) {
-			wl_list_remove(&output->buffer_destroy.link);
-			wlr_buffer_unlock(output->buffer);
-		}
-
-		if ((output->buffer = state->buffer)) {
-			wlr_buffer_lock(output->buffer);
-			wl_signal_add(&output->buffer->events.destroy,
-			              &output->buffer_destroy);
+	if ((state->committed & WLR_OUTPUT_STATE_BUFFER) && state->buffer &&
+	    (state->buffer->impl != qubes_buffer_impl_addr ||
+	     qubes_output_wants_stable_buffer(output, state->buffer))) {
+		if (!qubes_output_scan_out(output, state))
+			return false;
+	} else if ((state->committed & WLR_OUTPUT_STATE_BUFFER) &&
+	           (output->buffer != state->buffer)) {
+		if (qubes_output_attach_buffer(output, state->buffer))
 			qubes_output_dump_buffer(output, state);
-		}
 	}
 	if (state->committed & WLR_OUTPUT_STATE_ENABLED)
 		wlr_output_update_enabled(raw_output, state->enabled);
 	return true;
 }
 
-static const struct wlr_drm_format xrgb8888 = {
-	.format = DRM_FORMAT_XRGB8888,
-	.len = 2,
-	.capacity = 0,
-	.modifiers = { DRM_FORMAT_MOD_INVALID, DRM_FORMAT_MOD_LINEAR },
-};
-static const struct wlr_drm_format argb8888 = {
-	.format = DRM_FORMAT_ARGB8888,
-	.len = 2,
-	.capacity = 0,
-	.modifiers = { DRM_FORMAT_MOD_INVALID, DRM_FORMAT_MOD_LINEAR },
-};
-
 static const struct wlr_drm_format *const global_pointer_array[2] = {
 	&xrgb8888,
 	&argb8888,
@@ -289,6 +848,7 @@ static const struct wlr_drm_format_set *qubes_output_get_primary_formats(
 	return &global_formats;
 }
 
+/* No cursor planes: the daemon draws the pointer, see MSG_CURSOR in main.c */
 static const struct wlr_output_impl qubes_wlr_output_impl = {
 	.set_cursor = NULL,
 	.move_cursor = NULL,
@@ -301,6 +861,130 @@ static const struct wlr_output_impl qubes_wlr_output_impl = {
 	.get_primary_formats = qubes_output_get_primary_formats,
 };
 
+static void qubes_send_frame_done(struct wlr_scene_buffer *surface,
+                                  int sx __attribute__((unused)),
+                                  int sy __attribute__((unused)), void *data)
+{
+	wlr_scene_buffer_send_frame_done(surface, data);
+}
+
+/*
+ * A surface of a window, either the main surface or one of its (possibly
+ * nested) subsurfaces.  A commit that adds frame callbacks puts the surface
+ * on the dirty list of its output, and only the surfaces on that list get
+ * frame callbacks.  A frame therefore costs O(surfaces that committed) rather
+ * than a walk over every buffer in the scene, which matters for clients with
+ * many subsurfaces of which only one is redrawn, such as video players.
+ * Rendering is already limited to the damaged part of the scene by wlroots.
+ */
+struct qubes_surface_tracker {
+	struct wl_list link;       /* qubes_output::tracked_surfaces */
+	struct wl_list dirty_link; /* qubes_output::dirty_surfaces, or empty */
+	struct qubes_output *output;
+	struct wlr_surface *surface;
+	struct wl_listener commit;
+	struct wl_listener new_subsurface;
+	struct wl_listener destroy;            /* of the surface */
+	struct wl_listener subsurface_destroy; /* of its subsurface role, if any */
+};
+
+/* Send frame callbacks to the surfaces that asked for one since last time */
+static void qubes_output_send_frame_done(struct qubes_output *output,
+                                         const struct timespec *now)
+{
+	if (output->flags & QUBES_OUTPUT_UNTRACKED_SURFACE) {
+		/* Some surface could not be tracked, so visit all of them */
+		wlr_scene_node_for_each_buffer(&output->scene->tree.node,
+		                               qubes_send_frame_done, (void *)now);
+	}
+	struct qubes_surface_tracker *tracker, *tmp;
+	wl_list_for_each_safe(tracker, tmp, &output->dirty_surfaces, dirty_link) {
+		wl_list_remove(&tracker->dirty_link);
+		wl_list_init(&tracker->dirty_link);
+		if (!(output->flags & QUBES_OUTPUT_UNTRACKED_SURFACE))
+			wlr_surface_send_frame_done(tracker->surface, now);
+		output->stats.surfaces_done++;
+	}
+}
+
+enum {
+	/* Longest time a frame is paced to, in milliseconds */
+	QUBES_PACING_MAX_INTERVAL = 250,
+	/* Length of the samples behind the effective frame rate, in microseconds */
+	QUBES_PACING_SAMPLE_US = 1000000,
+	/* How long a hidden window keeps its buffers, in milliseconds */
+	QUBES_HIDDEN_GRACE_MS = 5000,
+};
+
+/*
+ * Length of one refresh cycle of this output, in milliseconds.  This is
+ * stretched to the time the daemon takes to acknowledge a dump, which is as
+ * fast as it can show this window.
+ */
+static int qubes_output_refresh_interval(struct qubes_output *output)
+{
+	int const refresh =
+	   output->refresh <= 0 ? 16 : QUBES_MAX(1000000 / output->refresh, 1);
+	int const ack = (int)QUBES_MIN(output->pacing.ack_us / 1000,
+	                               (uint64_t)QUBES_PACING_MAX_INTERVAL);
+	return QUBES_MAX(refresh, ack);
+}
+
+/* Let the clients of this output draw their next frame */
+static void qubes_output_release_frame(struct qubes_output *output)
+{
+	/* Hidden windows get their next frame when shown again */
+	if (output->visibility != QUBES_OUTPUT_VISIBLE)
+		return;
+	struct timespec now;
+	assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+	uint64_t const now_us =
+	   (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+	uint64_t const elapsed = now_us - output->pacing.sample_us;
+	output->pacing.sample_frames++;
+	if (elapsed >= QUBES_PACING_SAMPLE_US) {
+		output->pacing.fps_milli =
+		   (uint32_t)QUBES_MIN((uint64_t)output->pacing.sample_frames *
+		                          1000000000 / elapsed,
+		                       (uint64_t)UINT32_MAX);
+		output->pacing.sample_us = now_us;
+		output->pacing.sample_frames = 0;
+	}
+	output->output.frame_pending = false;
+	/* Disabled surfaces keep their callbacks until they are enabled again */
+	if (!output->scene_subsurface_tree ||
+	    output->scene_subsurface_tree->node.enabled)
+		qubes_output_send_frame_done(output, &now);
+	if (output->output.needs_frame && qubes_output_mapped(output))
+		wlr_output_send_frame(&output->output);
+}
+
+/*
+ * Timer callback that stands in for a vblank.  It sends frame callbacks to
+ * the buffers of this output only, and renders another frame only if someone
+ * asked for one since the last frame.  An output with no activity therefore
+ * never wakes up the compositor.
+ *
+ * If the daemon has not acknowledged the last dump of this window by the end
+ * of the refresh cycle, it is not keeping up with the window.  The frame
+ * callbacks are then held until the ACK comes in, so clients draw at the rate
+ * the daemon sustains instead of drawing frames nobody sees.
+ */
+static int qubes_output_frame_done(void *data)
+{
+	struct qubes_output *output = data;
+	assert(QUBES_VIEW_MAGIC == output->magic ||
+	       QUBES_XWAYLAND_MAGIC == output->magic);
+	output->flags &= ~QUBES_OUTPUT_FRAME_SCHEDULED;
+	if (output->dumps_in_flight > 0 && qubes_output_mapped(output)) {
+		output->flags |= QUBES_OUTPUT_FRAME_THROTTLED;
+		output->stats.frames_throttled++;
+		return 0;
+	}
+	qubes_output_release_frame(output);
+	return 0;
+}
+
 static void qubes_output_frame(struct wl_listener *listener,
                                void *data __attribute__((unused)))
 {
@@ -308,20 +992,200 @@ static void qubes_output_frame(struct wl_listener *listener,
 	assert(QUBES_VIEW_MAGIC == output->magic ||
 	       QUBES_XWAYLAND_MAGIC == output->magic);
 	if (qubes_output_mapped(output) &&
-	    !wlr_scene_output_commit(output->scene_output)) {
-		return;
+	    output->visibility == QUBES_OUTPUT_VISIBLE) {
+		/*
+		 * A direct scanout commit carries no damage, so qubes_output_scan_out()
+		 * takes it from the damage ring.  wlr_scene only rotates the ring when
+		 * it renders, so it is rotated here once that damage has been sent.
+		 */
+		output->frame_damage = &output->scene_output->damage_ring.current;
+		bool const rendered = wlr_scene_output_commit(output->scene_output);
+		output->frame_damage = NULL;
+		if (output->flags & QUBES_OUTPUT_SCANOUT_DAMAGE_USED) {
+			output->flags &= ~QUBES_OUTPUT_SCANOUT_DAMAGE_USED;
+			wlr_damage_ring_rotate(&output->scene_output->damage_ring);
+		}
+		QUBES_TRACE(frame, output->window_id, rendered);
+		// The commit can fail, e.g. if the size is bad.  Frame callbacks are
+		// still sent, or clients waiting for one would stall.
+		if (rendered)
+			output->stats.frames++;
 	}
 	output->output.frame_pending = true;
-	if (!output->server->frame_pending) {
-		// Schedule another timer callback
-		wl_event_source_timer_update(output->server->timer, 16);
-		output->server->frame_pending = true;
+	if (!(output->flags & QUBES_OUTPUT_FRAME_SCHEDULED)) {
+		// Schedule the frame callbacks for the end of this refresh cycle
+		wl_event_source_timer_update(output->frame_timer,
+		                             qubes_output_refresh_interval(output));
+		output->flags |= QUBES_OUTPUT_FRAME_SCHEDULED;
+	}
+}
+
+/*
+ * Timer callback that releases the buffers of a window that stayed hidden
+ * for QUBES_HIDDEN_GRACE_MS.  The daemon keeps what it was sent last, and the
+ * window gets a new buffer when it is shown again.
+ */
+static int qubes_output_hidden_timeout(void *data)
+{
+	struct qubes_output *output = data;
+	if (output->visibility == QUBES_OUTPUT_VISIBLE)
+		return 0;
+	wlr_log(WLR_DEBUG, "Releasing buffers of hidden window %" PRIu32,
+	        output->window_id);
+	output->stats.hidden_releases++;
+	qubes_output_attach_buffer(output, NULL);
+	if (output->scanout_buffer) {
+		wlr_buffer_drop(output->scanout_buffer);
+		output->scanout_buffer = NULL;
+	}
+	free(output->shadow.pixels);
+	output->shadow.pixels = NULL;
+	output->shadow.width = output->shadow.height = 0;
+	/* wlroots frees the swapchain of an output that is disabled */
+	if (output->output.enabled && qubes_output_created(output)) {
+		wlr_output_enable(&output->output, false);
+		if (!wlr_output_commit(&output->output))
+			wlr_log(WLR_ERROR, "Cannot disable hidden window %" PRIu32,
+			        output->window_id);
+	}
+	return 0;
+}
+
+void qubes_output_set_visibility(struct qubes_output *output,
+                                 enum qubes_output_visibility visibility)
+{
+	enum qubes_output_visibility const old = output->visibility;
+	if (old == visibility)
+		return;
+	output->visibility = visibility;
+	if (visibility != QUBES_OUTPUT_VISIBLE) {
+		if (old == QUBES_OUTPUT_VISIBLE)
+			wl_event_source_timer_update(output->hidden_timer,
+			                             QUBES_HIDDEN_GRACE_MS);
+		return;
+	}
+
+	wl_event_source_timer_update(output->hidden_timer, 0);
+	/*
+	 * Nothing was sent while the window was hidden.  Forgetting the buffer
+	 * the daemon has makes the next frame a single dump of the whole window,
+	 * instead of damage against a buffer that may be gone.
+	 */
+	qubes_output_attach_buffer(output, NULL);
+	if (qubes_output_mapped(output))
+		wlr_output_enable(&output->output, true);
+	wlr_damage_ring_add_whole(&output->scene_output->damage_ring);
+	qubes_output_release_frame(output);
+	wlr_output_schedule_frame(&output->output);
+}
+
+static void qubes_surface_tracker_destroy(struct qubes_surface_tracker *tracker)
+{
+	wl_list_remove(&tracker->link);
+	wl_list_remove(&tracker->dirty_link);
+	wl_list_remove(&tracker->commit.link);
+	wl_list_remove(&tracker->new_subsurface.link);
+	wl_list_remove(&tracker->destroy.link);
+	wl_list_remove(&tracker->subsurface_destroy.link);
+	free(tracker);
+}
+
+static void qubes_surface_tracker_commit(struct wl_listener *listener,
+                                         void *data __attribute__((unused)))
+{
+	struct qubes_surface_tracker *tracker =
+	   wl_container_of(listener, tracker, commit);
+	if (wl_list_empty(&tracker->dirty_link) &&
+	    !wl_list_empty(&tracker->surface->current.frame_callback_list))
+		wl_list_insert(tracker->output->dirty_surfaces.prev,
+		               &tracker->dirty_link);
+}
+
+static void qubes_surface_tracker_handle_destroy(struct wl_listener *listener,
+                                                 void *data
+                                                 __attribute__((unused)))
+{
+	struct qubes_surface_tracker *tracker =
+	   wl_container_of(listener, tracker, destroy);
+	qubes_surface_tracker_destroy(tracker);
+}
+
+static void
+qubes_surface_tracker_handle_subsurface_destroy(struct wl_listener *listener,
+                                                void *data
+                                                __attribute__((unused)))
+{
+	struct qubes_surface_tracker *tracker =
+	   wl_container_of(listener, tracker, subsurface_destroy);
+	qubes_surface_tracker_destroy(tracker);
+}
+
+static void qubes_output_track_surface(struct qubes_output *output,
+                                       struct wlr_surface *surface,
+                                       struct wlr_subsurface *subsurface);
+
+static void qubes_surface_tracker_new_subsurface(struct wl_listener *listener,
+                                                 void *data)
+{
+	struct qubes_surface_tracker *tracker =
+	   wl_container_of(listener, tracker, new_subsurface);
+	struct wlr_subsurface *subsurface = data;
+	qubes_output_track_surface(tracker->output, subsurface->surface,
+	                           subsurface);
+}
+
+/* Track surface and its subsurfaces.  See struct qubes_surface_tracker. */
+static void qubes_output_track_surface(struct qubes_output *output,
+                                       struct wlr_surface *surface,
+                                       struct wlr_subsurface *subsurface)
+{
+	struct qubes_surface_tracker *tracker = calloc(sizeof(*tracker), 1);
+	if (!tracker) {
+		wlr_log(WLR_ERROR, "Cannot track surface of window %" PRIu32
+		                   ", frames will visit every surface",
+		        output->window_id);
+		output->flags |= QUBES_OUTPUT_UNTRACKED_SURFACE;
+		return;
 	}
+	tracker->output = output;
+	tracker->surface = surface;
+	wl_list_insert(&output->tracked_surfaces, &tracker->link);
+	wl_list_init(&tracker->dirty_link);
+	tracker->commit.notify = qubes_surface_tracker_commit;
+	wl_signal_add(&surface->events.commit, &tracker->commit);
+	tracker->new_subsurface.notify = qubes_surface_tracker_new_subsurface;
+	wl_signal_add(&surface->events.new_subsurface, &tracker->new_subsurface);
+	tracker->destroy.notify = qubes_surface_tracker_handle_destroy;
+	wl_signal_add(&surface->events.destroy, &tracker->destroy);
+	tracker->subsurface_destroy.notify =
+	   qubes_surface_tracker_handle_subsurface_destroy;
+	if (subsurface)
+		wl_signal_add(&subsurface->events.destroy, &tracker->subsurface_destroy);
+	else
+		wl_list_init(&tracker->subsurface_destroy.link);
+
+	/* Callbacks requested before the surface was shown here */
+	qubes_surface_tracker_commit(&tracker->commit, NULL);
+
+	struct wlr_subsurface *child;
+	wl_list_for_each(child, &surface->current.subsurfaces_below, current.link)
+		qubes_output_track_surface(output, child->surface, child);
+	wl_list_for_each(child, &surface->current.subsurfaces_above, current.link)
+		qubes_output_track_surface(output, child->surface, child);
+}
+
+static void qubes_output_untrack_surfaces(struct qubes_output *output)
+{
+	struct qubes_surface_tracker *tracker, *tmp;
+	wl_list_for_each_safe(tracker, tmp, &output->tracked_surfaces, link)
+		qubes_surface_tracker_destroy(tracker);
+	output->flags &= ~QUBES_OUTPUT_UNTRACKED_SURFACE;
 }
 
 static void qubes_output_clear_surface(struct qubes_output *const output)
 {
 	wlr_log(WLR_DEBUG, "Surface clear for window %" PRIu32, output->window_id);
+	qubes_output_untrack_surfaces(output);
 	if (output->scene_subsurface_tree)
 		wlr_scene_node_destroy(&output->scene_subsurface_tree->node);
 	output->scene_subsurface_tree = NULL;
@@ -342,10 +1206,23 @@ bool qubes_output_set_surface(struct qubes_output *const output,
 	         &output->scene_output->scene->tree, surface)))
 		return false;
 	output->surface = surface;
+	qubes_output_track_surface(output, surface, NULL);
 	wlr_scene_node_raise_to_top(&output->scene_subsurface_tree->node);
 	return true;
 }
 
+/* Spare outputs kept per server, see qubes_output_park() */
+enum { QUBES_MAX_SPARE_OUTPUTS = 4 };
+
+/* Zero the window state of an output, leaving what can be reused */
+static void qubes_output_reset_window(struct qubes_output *const output)
+{
+	memset(&output->link, 0,
+	       sizeof(*output) - offsetof(struct qubes_output, link));
+	wl_list_init(&output->tracked_surfaces);
+	wl_list_init(&output->dirty_surfaces);
+}
+
 bool qubes_output_init(struct qubes_output *const output,
                        struct tinywl_server *const server,
                        bool const is_override_redirect,
@@ -353,15 +1230,33 @@ bool qubes_output_init(struct qubes_output *const output,
                        int32_t x, int32_t y, uint32_t width, uint32_t height)
 {
 	assert(output);
+	assert(server);
+	assert(magic == QUBES_VIEW_MAGIC || magic == QUBES_XWAYLAND_MAGIC);
+	if (output->scene) {
+		/* Parked by qubes_output_park() and handed out again */
+		assert(output->magic == magic && output->server == server);
+		qubes_output_reset_window(output);
+		output->view_size = 0;
+		output->refresh = server->backend->mode.refresh;
+		output->buffer_destroy.notify = qubes_unlink_buffer_listener;
+		output->visibility = QUBES_OUTPUT_VISIBLE;
+		output->flags = is_override_redirect ? QUBES_OUTPUT_OVERRIDE_REDIRECT : 0;
+		/* Undo what unmapping the previous window did */
+		wlr_scene_node_set_enabled(&output->scene->tree.node, true);
+		wlr_output_update_enabled(&output->output, true);
+		wl_list_insert(&server->views, &output->link);
+		return qubes_output_set_surface(output, surface);
+	}
 	memset(output, 0, sizeof *output);
+	wl_list_init(&output->tracked_surfaces);
+	wl_list_init(&output->dirty_surfaces);
 
-	assert(server);
 	struct wlr_backend *const backend = &server->backend->backend;
-	assert(magic == QUBES_VIEW_MAGIC || magic == QUBES_XWAYLAND_MAGIC);
 
 	wlr_output_init(&output->output, backend, &qubes_wlr_output_impl,
 	                server->wl_display);
-	wlr_output_update_custom_mode(&output->output, 1280, 720, 0);
+	output->refresh = server->backend->mode.refresh;
+	wlr_output_update_custom_mode(&output->output, 1280, 720, output->refresh);
 	wlr_output_update_enabled(&output->output, true);
 
 	if (asprintf(&output->name, "Virtual Output %" PRIu64,
@@ -380,6 +1275,14 @@ bool qubes_output_init(struct qubes_output *const output,
 	output->flags = is_override_redirect ? QUBES_OUTPUT_OVERRIDE_REDIRECT : 0,
 	output->server = server;
 	wl_signal_add(&output->output.events.frame, &output->frame);
+	if (!(output->frame_timer = wl_event_loop_add_timer(
+	         wl_display_get_event_loop(server->wl_display),
+	         qubes_output_frame_done, output)))
+		return false;
+	if (!(output->hidden_timer = wl_event_loop_add_timer(
+	         wl_display_get_event_loop(server->wl_display),
+	         qubes_output_hidden_timeout, output)))
+		return false;
 
 	wl_list_insert(&server->views, &output->link);
 	assert(output->output.allocator == NULL);
@@ -395,7 +1298,31 @@ bool qubes_output_init(struct qubes_output *const output,
 	return qubes_output_set_surface(output, surface);
 }
 
-void qubes_send_configure(struct qubes_output *output)
+/*
+ * Returns true if a message with this body would only repeat the last
+ * message of the same kind sent for this window.  Otherwise, records the
+ * body as the last one sent and returns false.
+ */
+static bool qubes_output_is_duplicate(struct qubes_output *output,
+                                      uint32_t kind, void *last,
+                                      const void *body, size_t size)
+{
+	if ((output->sent.valid & kind) && memcmp(last, body, size) == 0) {
+		output->suppressed_messages++;
+		return true;
+	}
+	memcpy(last, body, size);
+	output->sent.valid |= kind;
+	return false;
+}
+
+/*
+ * Send MSG_CONFIGURE.  Unless force is set, nothing is sent if the daemon
+ * already has the current geometry.  MSG_CONFIGURE also serves as the ACK of
+ * a MSG_CONFIGURE from the daemon, and those must always be sent.
+ */
+static void qubes_output_send_configure(struct qubes_output *output,
+                                        bool force)
 {
 	if (!qubes_output_created(output))
 		return;
@@ -422,19 +1349,54 @@ void qubes_send_configure(struct qubes_output *output)
 	};
 	QUBES_STATIC_ASSERT(sizeof msg == sizeof msg.header + sizeof msg.configure);
 	// clang-format on
+	if (force) {
+		output->sent.configure = msg.configure;
+		output->sent.valid |= QUBES_SENT_CONFIGURE;
+	} else if (qubes_output_is_duplicate(output, QUBES_SENT_CONFIGURE,
+	                                     &output->sent.configure, &msg.configure,
+	                                     sizeof msg.configure)) {
+		return;
+	}
 	wlr_log(WLR_DEBUG, "Sending MSG_CONFIGURE (0x%x) to window %" PRIu32,
 	        MSG_CONFIGURE, output->window_id);
-	qubes_rust_send_message(output->server->backend->rust_backend,
-	                        (struct msg_hdr *)&msg);
+	qubes_output_send(output, (struct msg_hdr *)&msg);
 	output->host = output->guest;
 }
 
+void qubes_send_configure(struct qubes_output *output)
+{
+	qubes_output_send_configure(output, true);
+}
+
+void qubes_output_send_hints(struct qubes_output *output,
+                             const struct msg_window_hints *hints)
+{
+	assert(qubes_output_created(output));
+	assert(output->window_id != 0);
+	if (qubes_output_is_duplicate(output, QUBES_SENT_HINTS, &output->sent.hints,
+	                              hints, sizeof *hints))
+		return;
+	// clang-format off
+	struct {
+		struct msg_hdr header;
+		struct msg_window_hints hints;
+	} msg = {
+		.header = {
+			.type = MSG_WINDOW_HINTS,
+			.window = output->window_id,
+			.untrusted_len = sizeof(msg.hints),
+		},
+		.hints = *hints,
+	};
+	// clang-format on
+	QUBES_STATIC_ASSERT(sizeof msg == sizeof msg.header + sizeof msg.hints);
+	qubes_output_send(output, (struct msg_hdr *)&msg);
+}
+
 void qubes_set_view_title(struct qubes_output *output, const char *const title)
 {
 	assert(qubes_output_created(output));
 	assert(output->window_id);
-	wlr_log(WLR_DEBUG, "Sending MSG_WMNAME (0x%x) to window %" PRIu32,
-	        MSG_WMNAME, output->window_id);
 	struct {
 		struct msg_hdr header;
 		struct msg_wmname title;
@@ -447,9 +1409,13 @@ void qubes_set_view_title(struct qubes_output *output, const char *const title)
 	strncpy(msg.title.data, title, sizeof msg.title.data - 1);
 	msg.title.data[sizeof msg.title.data - 1] = 0;
 	QUBES_STATIC_ASSERT(sizeof msg == sizeof msg.header + sizeof msg.title);
+	if (qubes_output_is_duplicate(output, QUBES_SENT_TITLE, &output->sent.title,
+	                              &msg.title, sizeof msg.title))
+		return;
+	wlr_log(WLR_DEBUG, "Sending MSG_WMNAME (0x%x) to window %" PRIu32,
+	        MSG_WMNAME, output->window_id);
 	// Asserted above, checked at call sites
-	qubes_rust_send_message(output->server->backend->rust_backend,
-	                        (struct msg_hdr *)&msg);
+	qubes_output_send(output, (struct msg_hdr *)&msg);
 }
 
 struct wlr_surface *qubes_output_surface(struct qubes_output *output)
@@ -469,10 +1435,13 @@ struct wlr_surface *qubes_output_surface(struct qubes_output *output)
 	}
 }
 
-void qubes_output_deinit(struct qubes_output *output)
+/* Tear down the window, but not the output, scene or timers */
+static void qubes_output_release_window(struct qubes_output *output)
 {
+	qubes_output_untrack_surfaces(output);
 	if (output->scene_subsurface_tree)
 		wlr_scene_node_destroy(&output->scene_subsurface_tree->node);
+	output->scene_subsurface_tree = NULL;
 	wl_list_remove(&output->link);
 	assert(output->magic == QUBES_VIEW_MAGIC ||
 	       output->magic == QUBES_XWAYLAND_MAGIC);
@@ -484,8 +1453,23 @@ void qubes_output_deinit(struct qubes_output *output)
 	if (qubes_output_created(output)) {
 		wlr_log(WLR_DEBUG, "Sending MSG_DESTROY (0x%x) to window %" PRIu32,
 		        MSG_DESTROY, output->window_id);
-		qubes_rust_send_message(output->server->backend->rust_backend, &header);
+		qubes_output_send(output, &header);
 	}
+	qubes_dump_ring_forget(&output->server->dumps, output);
+	if (output->scanout_buffer)
+		wlr_buffer_drop(output->scanout_buffer);
+	output->scanout_buffer = NULL;
+	free(output->shadow.pixels);
+	output->shadow.pixels = NULL;
+}
+
+void qubes_output_deinit(struct qubes_output *output)
+{
+	qubes_output_release_window(output);
+	if (output->frame_timer)
+		wl_event_source_remove(output->frame_timer);
+	if (output->hidden_timer)
+		wl_event_source_remove(output->hidden_timer);
 	if (output->scene_output) {
 		wlr_scene_output_destroy(output->scene_output);
 	}
@@ -496,6 +1480,59 @@ void qubes_output_deinit(struct qubes_output *output)
 	free(output->name);
 }
 
+void *qubes_output_alloc_view(struct tinywl_server *server, uint32_t magic,
+                              size_t view_size, bool override_redirect)
+{
+	assert(view_size >= sizeof(struct qubes_output));
+	struct qubes_output *output;
+	if (override_redirect) {
+		wl_list_for_each (output, &server->spare_outputs, link) {
+			if (output->magic != magic || output->view_size != view_size)
+				continue;
+			wl_list_remove(&output->link);
+			server->n_spare_outputs--;
+			/* The output is reset by qubes_output_init() */
+			memset((char *)output + sizeof(*output), 0,
+			       view_size - sizeof(*output));
+			return output;
+		}
+	}
+	return calloc(1, view_size);
+}
+
+bool qubes_output_park(struct qubes_output *output, size_t view_size)
+{
+	struct tinywl_server *server = output->server;
+	if (!(output->flags & QUBES_OUTPUT_OVERRIDE_REDIRECT) || !output->scene ||
+	    server->n_spare_outputs >= QUBES_MAX_SPARE_OUTPUTS)
+		return false;
+	qubes_output_attach_buffer(output, NULL);
+	qubes_output_release_window(output);
+	wl_event_source_timer_update(output->frame_timer, 0);
+	wl_event_source_timer_update(output->hidden_timer, 0);
+	/* Drop a disable left pending by qubes_output_unmap() */
+	wlr_output_rollback(&output->output);
+	/* Keeps the swapchain, which the next popup of this size reuses */
+	output->output.frame_pending = false;
+	output->visibility = QUBES_OUTPUT_VISIBLE;
+	output->flags = 0;
+	output->view_size = view_size;
+	wl_list_insert(&server->spare_outputs, &output->link);
+	server->n_spare_outputs++;
+	return true;
+}
+
+void qubes_output_free_spares(struct tinywl_server *server)
+{
+	struct qubes_output *output, *tmp;
+	wl_list_for_each_safe (output, tmp, &server->spare_outputs, link) {
+		/* Removes the output from the list */
+		qubes_output_deinit(output);
+		free(output); /* the view, which starts with the output */
+	}
+	server->n_spare_outputs = 0;
+}
+
 void qubes_change_window_flags(struct qubes_output *output, uint32_t flags_set,
                                uint32_t flags_unset)
 {
@@ -520,13 +1557,13 @@ void qubes_change_window_flags(struct qubes_output *output, uint32_t flags_set,
 	// Asserted above, checked at call sites
 	wlr_log(WLR_DEBUG, "Sending MSG_WINDOW_FLAGS (0x%x) to window %" PRIu32,
 	        MSG_DESTROY, output->window_id);
-	qubes_rust_send_message(output->server->backend->rust_backend,
-	                        (struct msg_hdr *)&msg);
+	qubes_output_send(output, (struct msg_hdr *)&msg);
 }
 
 void qubes_output_unmap(struct qubes_output *output)
 {
 	output->flags &= ~(__typeof__(output->flags))QUBES_OUTPUT_MAPPED;
+	qubes_output_set_visibility(output, QUBES_OUTPUT_UNMAPPED);
 	wlr_output_enable(&output->output, false);
 	struct msg_hdr header = {
 		.type = MSG_UNMAP,
@@ -536,7 +1573,7 @@ void qubes_output_unmap(struct qubes_output *output)
 	if (qubes_output_created(output)) {
 		wlr_log(WLR_DEBUG, "Sending MSG_UNMAP (0x%x) to window %" PRIu32,
 		        MSG_UNMAP, output->window_id);
-		qubes_rust_send_message(output->server->backend->rust_backend, &header);
+		qubes_output_send(output, &header);
 	}
 }
 
@@ -545,9 +1582,13 @@ void qubes_output_map(struct qubes_output *output,
 {
 	if (!qubes_output_mapped(output)) {
 		output->flags |= QUBES_OUTPUT_MAPPED;
+		/* Both are disabled when an xdg surface is unmapped */
+		wlr_scene_node_set_enabled(&output->scene->tree.node, true);
 		wlr_scene_node_set_enabled(&output->scene_subsurface_tree->node, true);
 		wlr_output_enable(&output->output, true);
 	}
+	if (output->visibility == QUBES_OUTPUT_UNMAPPED)
+		qubes_output_set_visibility(output, QUBES_OUTPUT_VISIBLE);
 
 	// clang-format off
 	struct {
@@ -570,8 +1611,7 @@ void qubes_output_map(struct qubes_output *output,
 	wlr_log(WLR_DEBUG,
 	        "Sending MSG_MAP (0x%x) to window %u (transient_for = %u)", MSG_MAP,
 	        output->window_id, transient_for_window);
-	qubes_rust_send_message(output->server->backend->rust_backend,
-	                        (struct msg_hdr *)&msg);
+	qubes_output_send(output, (struct msg_hdr *)&msg);
 }
 
 bool qubes_output_configure(struct qubes_output *output, struct wlr_box box)
@@ -584,8 +1624,8 @@ bool qubes_output_configure(struct qubes_output *output, struct wlr_box box)
 		if (!qubes_output_ensure_created(output))
 			return false;
 		wlr_output_update_custom_mode(&output->output, output->guest.width,
-		                              output->guest.height, 60000);
-		qubes_send_configure(output);
+		                              output->guest.height, output->refresh);
+		qubes_output_send_configure(output, false);
 		wlr_output_send_frame(&output->output);
 		return true;
 	}
@@ -596,8 +1636,6 @@ void qubes_output_set_class(struct qubes_output *output, const char *class)
 {
 	assert(qubes_output_created(output));
 	assert(output->window_id);
-	wlr_log(WLR_DEBUG, "Sending MSG_WMCLASS (0x%x) to window %" PRIu32,
-	        MSG_WMCLASS, output->window_id);
 	// clang-format off
 	struct {
 		struct msg_hdr header;
@@ -616,9 +1654,68 @@ void qubes_output_set_class(struct qubes_output *output, const char *class)
 	// clang-format on
 	QUBES_STATIC_ASSERT(sizeof msg == sizeof msg.header + sizeof msg.class);
 	strncpy(msg.class.res_class, class, sizeof(msg.class.res_class) - 1);
+	if (qubes_output_is_duplicate(output, QUBES_SENT_CLASS, &output->sent.class,
+	                              &msg.class, sizeof msg.class))
+		return;
+	wlr_log(WLR_DEBUG, "Sending MSG_WMCLASS (0x%x) to window %" PRIu32,
+	        MSG_WMCLASS, output->window_id);
 	// Asserted above, checked at call sites
-	qubes_rust_send_message(output->server->backend->rust_backend,
-	                        (struct msg_hdr *)&msg);
+	qubes_output_send(output, (struct msg_hdr *)&msg);
+}
+
+/* Grant pages pinned by this output: its buffers and its unacked dumps */
+static uint64_t qubes_output_grant_pages(struct qubes_output *output)
+{
+	struct qubes_dump_ring *ring = &output->server->dumps;
+	uint64_t pages = 0;
+	struct qubes_buffer *buffer;
+	if (output->buffer && output->buffer->impl == qubes_buffer_impl_addr) {
+		buffer = wl_container_of(output->buffer, buffer, inner);
+		pages += buffer->pages;
+	}
+	if (output->scanout_buffer && output->scanout_buffer != output->buffer) {
+		buffer = wl_container_of(output->scanout_buffer, buffer, inner);
+		pages += buffer->pages;
+	}
+	for (uint32_t i = 0; i < ring->len; ++i) {
+		struct qubes_dump *dump =
+		   ring->dumps + ((ring->head + i) & (ring->capacity - 1));
+		if (dump->output == output && &dump->buffer->inner != output->buffer)
+			pages += dump->buffer->pages;
+	}
+	return pages;
+}
+
+void qubes_output_log_stats(struct qubes_output *output)
+{
+	const struct qubes_output_stats *stats = &output->stats;
+	wlr_log(WLR_INFO,
+	        "Window %" PRIu32 " (%s, %" PRIu32 "x%" PRIu32 "): "
+	        "%" PRIu64 " commits, %" PRIu64 " frames, "
+	        "%" PRIu64 " MSG_SHMIMAGE (%" PRIu64 " pixels), "
+	        "%" PRIu64 " messages (%" PRIu64 " bytes), "
+	        "%" PRIu64 " suppressed, %" PRIu64 " dumps (%" PRIu64 " held, %" PRIu64
+	        " acked, %" PRIu32 " in flight, ACK latency avg %" PRIu64
+	        " us max %" PRIu64 " us), %" PRIu64 " grant pages, "
+	        "%" PRIu64 " of %" PRIu64 " diffed pixels changed, "
+	        "%" PRIu32 ".%03" PRIu32 " effective FPS (%" PRIu64 " throttled), "
+	        "%s, %" PRIu64 " releases while hidden, "
+	        "%" PRIu64 " surface frame callbacks, "
+	        "%" PRIu64 " configures coalesced",
+	        output->window_id, output->name ? output->name : "unnamed",
+	        output->guest.width, output->guest.height, stats->commits,
+	        stats->frames, stats->shmimages, stats->damage_pixels,
+	        stats->messages, stats->bytes, output->suppressed_messages,
+	        stats->dumps, stats->dumps_held, stats->acks,
+	        output->dumps_in_flight,
+	        stats->acks ? stats->ack_us_total / stats->acks : 0,
+	        stats->ack_us_max, qubes_output_grant_pages(output),
+	        stats->diff_pixels_sent, stats->diff_pixels_compared,
+	        output->pacing.fps_milli / 1000, output->pacing.fps_milli % 1000,
+	        stats->frames_throttled,
+	        output->visibility == QUBES_OUTPUT_VISIBLE ? "visible" : "hidden",
+	        stats->hidden_releases, stats->surfaces_done,
+	        stats->configures_coalesced);
 }
 
 /* vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8: */
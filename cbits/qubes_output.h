@@ -9,35 +9,115 @@
 
 #include <qubes-gui-protocol.h>
 
+/* Per-window performance counters, logged on SIGUSR1 */
+struct qubes_output_stats {
+	uint64_t commits;                  /* wlr_output commits */
+	uint64_t frames;                   /* scene renders */
+	uint64_t shmimages;                /* MSG_SHMIMAGE sent */
+	uint64_t damage_pixels;            /* pixels covered by those */
+	uint64_t messages, bytes;          /* everything sent for this window */
+	uint64_t dumps, dumps_held;        /* MSG_WINDOW_DUMP sent and held back */
+	uint64_t acks;                     /* MSG_WINDOW_DUMP_ACK received */
+	uint64_t ack_us_total, ack_us_max; /* dump to ACK latency */
+	uint64_t diff_pixels_compared;     /* damage checked against the shadow */
+	uint64_t diff_pixels_sent;         /* the part of it that changed */
+	uint64_t frames_throttled;         /* frame callbacks held for an ACK */
+	uint64_t hidden_releases;          /* buffers released while hidden */
+	uint64_t surfaces_done;            /* surfaces sent frame callbacks */
+	uint64_t configures_coalesced;     /* daemon sizes that were skipped */
+};
+
+/* Whether the user can see a window, see qubes_output_set_visibility() */
+enum qubes_output_visibility {
+	QUBES_OUTPUT_VISIBLE,
+	QUBES_OUTPUT_MINIMIZED, /* the daemon set WINDOW_FLAG_MINIMIZE */
+	QUBES_OUTPUT_UNMAPPED,  /* MSG_UNMAP was sent */
+};
+
 struct qubes_output {
-	struct wl_list link;
+	/* Kept when a spare output is reused, see qubes_output_park() */
 	struct wlr_output output;
-	struct wl_listener buffer_destroy;
-	struct wlr_buffer *buffer;   /* owned by the compositor */
-	struct wlr_surface *surface; /* ditto */
 	struct wl_listener frame;
-	struct msg_keymap_notify keymap;
+	struct wl_event_source *frame_timer; /* emulates vblank for this output */
+	struct wl_event_source *hidden_timer; /* releases buffers when hidden */
 	const struct wlr_drm_format_set *formats; /* global */
 	struct tinywl_server *server;
 	struct wlr_scene *scene;
 	struct wlr_scene_output *scene_output;
-	struct wlr_scene_tree *scene_subsurface_tree;
 	char *name;
+	uint32_t magic;
+	int32_t refresh;  /* mHz, taken from the mode of the backend output */
+	size_t view_size; /* of the containing view, while parked */
+
+	/* Everything from here on belongs to the window, and is zeroed on reuse */
+	struct wl_list link;
+	struct wl_listener buffer_destroy;
+	struct wlr_buffer *buffer;   /* owned by the compositor */
+	struct wlr_buffer *scanout_buffer; /* receives copies of other buffers */
+	/* Damage of the scene commit in progress, see qubes_output_frame() */
+	const pixman_region32_t *frame_damage;
+	struct wlr_surface *surface; /* ditto */
+	enum qubes_output_visibility visibility;
+	struct msg_keymap_notify keymap;
+	struct wlr_scene_tree *scene_subsurface_tree;
+	struct wl_list tracked_surfaces; /* qubes_surface_tracker::link */
+	struct wl_list dirty_surfaces;   /* qubes_surface_tracker::dirty_link */
 
 	struct {
 		int32_t x, y;
 		uint32_t width, height;
 	} host, guest;
 	uint32_t window_id;
-	uint32_t magic;
 	uint32_t flags;
+
+	/* Last messages sent to the GUI daemon, used to skip duplicates */
+	struct {
+		struct msg_configure configure;
+		struct msg_window_hints hints;
+		struct msg_wmname title;
+		struct msg_wmclass class;
+		uint32_t valid; /* QUBES_SENT_* */
+	} sent;
+	uint64_t suppressed_messages; /* duplicates that were not sent */
+	uint32_t dumps_in_flight;     /* entries in the server's dump ring */
+	struct qubes_output_stats stats;
+	/* Frame pacing, see qubes_output_frame_done() */
+	struct {
+		uint64_t ack_us;        /* moving average of the dump to ACK latency */
+		uint64_t sample_us;     /* CLOCK_MONOTONIC start of the FPS sample */
+		uint32_t sample_frames; /* frame callbacks sent since then */
+		uint32_t fps_milli;     /* effective frame rate of the last sample */
+	} pacing;
+	/* What the daemon was last sent, if damage diffing is enabled */
+	struct {
+		uint8_t *pixels;
+		int32_t width, height;
+		uint64_t budget;  /* pixels compared per frame, at most the server's */
+		uint32_t backoff; /* frames left before this window diffs again */
+	} shadow;
+};
+
+/* A MSG_WINDOW_DUMP that the daemon has not acknowledged yet */
+struct qubes_dump {
+	struct qubes_buffer *buffer; /* holds a reference */
+	struct qubes_output *output; /* NULL once the output is gone */
+	uint64_t sent_us;            /* CLOCK_MONOTONIC */
+	uint32_t window_id;
 };
 
-struct qubes_link {
-	struct qubes_link *next;
-	struct qubes_buffer *buffer;
+/*
+ * Unacknowledged dumps of all windows, in the order they were sent.  The
+ * daemon acknowledges dumps in that order too.  The array only grows when
+ * every slot is in use, so sending a dump normally allocates nothing.
+ */
+struct qubes_dump_ring {
+	struct qubes_dump *dumps;
+	uint32_t head, len, capacity; /* capacity is 0 or a power of 2 */
 };
 
+/* Dumps a window may have in flight before new ones are held back */
+enum { QUBES_MAX_DUMPS_IN_FLIGHT = 4 };
+
 struct tinywl_server;
 struct wlr_xdg_surface;
 enum {
@@ -47,6 +127,21 @@ enum {
 	QUBES_OUTPUT_OVERRIDE_REDIRECT = 1 << 3,
 	QUBES_OUTPUT_NEED_CONFIGURE = 1 << 4,
 	QUBES_OUTPUT_DAMAGE_ALL = 1 << 5,
+	QUBES_OUTPUT_FRAME_SCHEDULED = 1 << 6,
+	QUBES_OUTPUT_DUMP_HELD = 1 << 7,
+	QUBES_OUTPUT_NEED_RECREATE = 1 << 8,
+	QUBES_OUTPUT_FRAME_THROTTLED = 1 << 9,
+	QUBES_OUTPUT_UNTRACKED_SURFACE = 1 << 10,
+	QUBES_OUTPUT_RESIZE_PENDING = 1 << 11,
+	QUBES_OUTPUT_SCANOUT_DAMAGE_USED = 1 << 12,
+};
+
+/* Which fields of qubes_output::sent are valid */
+enum {
+	QUBES_SENT_CONFIGURE = 1 << 0,
+	QUBES_SENT_HINTS = 1 << 1,
+	QUBES_SENT_TITLE = 1 << 2,
+	QUBES_SENT_CLASS = 1 << 3,
 };
 
 static inline bool qubes_output_created(struct qubes_output *output)
@@ -87,14 +182,46 @@ bool qubes_output_init(struct qubes_output *output,
    __attribute__((warn_unused_result));
 void qubes_output_deinit(struct qubes_output *output);
 
+/*
+ * Popups and menus come and go all the time, so the wlr_output, scene and
+ * swapchain of a destroyed override-redirect window are kept for the next
+ * one.  The view that contains the output (as its first member) is kept
+ * with it.
+ *
+ * qubes_output_alloc_view() returns a zeroed view of the given size, or a
+ * parked one whose output qubes_output_init() will reuse.
+ * qubes_output_park() is called instead of qubes_output_deinit() when a view
+ * is destroyed, once the view has removed its listeners; if it returns true
+ * the view must not be freed.  The scene must contain nothing but the
+ * surface.
+ */
+void *qubes_output_alloc_view(struct tinywl_server *server, uint32_t magic,
+                              size_t view_size, bool override_redirect);
+bool qubes_output_park(struct qubes_output *output, size_t view_size)
+   __attribute__((warn_unused_result));
+/* Free every parked view, before the backend is destroyed */
+void qubes_output_free_spares(struct tinywl_server *server);
+
 void qubes_parse_event(void *raw_backend, void *raw_view, uint32_t timestamp,
                        struct msg_hdr hdr, const uint8_t *ptr);
 void qubes_send_configure(struct qubes_output *output);
+void qubes_output_send_hints(struct qubes_output *output,
+                             const struct msg_window_hints *hints);
 void qubes_output_dump_buffer(struct qubes_output *output,
                               const struct wlr_output_state *state);
+/* Handle MSG_WINDOW_DUMP_ACK, which may be for a window that is gone */
+void qubes_output_dump_acked(struct tinywl_server *server, uint32_t window_id);
+/* Drop all unacknowledged dumps, e.g. because the daemon went away */
+void qubes_dump_ring_release(struct qubes_dump_ring *ring);
 bool qubes_output_ensure_created(struct qubes_output *output);
 bool qubes_output_configure(struct qubes_output *output, struct wlr_box box);
 void qubes_output_unmap(struct qubes_output *output);
+/*
+ * Hidden windows get no frame callbacks and are not composited, and release
+ * their buffers after a grace period.  Showing a window sends it in full.
+ */
+void qubes_output_set_visibility(struct qubes_output *output,
+                                 enum qubes_output_visibility visibility);
 void qubes_change_window_flags(struct qubes_output *output, uint32_t flags_set,
                                uint32_t flags_unset);
 bool qubes_output_set_surface(struct qubes_output *const output,
@@ -105,6 +232,8 @@ struct wlr_surface *qubes_output_surface(struct qubes_output *output);
 void qubes_set_view_title(struct qubes_output *output, const char *const title);
 void qubes_output_set_class(struct qubes_output *output, const char *class);
 bool qubes_output_move(struct qubes_output *output, int32_t x, int32_t y);
+/* Log the performance counters of an output */
+void qubes_output_log_stats(struct qubes_output *output);
 
 #endif /* !defined QUBES_WAYLAND_COMPOSITOR_OUTPUT_H */
 // vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
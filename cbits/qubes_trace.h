@@ -0,0 +1,35 @@
+#ifndef QUBES_WAYLAND_COMPOSITOR_TRACE_H
+#define QUBES_WAYLAND_COMPOSITOR_TRACE_H                                       \
+	_Pragma("GCC error \"double-include guard referenced\"")
+
+/*
+ * Static tracepoints (USDT) in the "qubes" provider, for perf and bpftrace.
+ * A probe that nobody is attached to is a single nop, and its arguments are
+ * only evaluated into registers, so probes can stay on hot paths.  List them
+ * with "bpftrace -l 'usdt:/usr/bin/qubes-compositor:qubes:*'".
+ *
+ * The first argument of every probe is the window ID.  Tracers timestamp
+ * events themselves, so only times that exist anyway are passed.
+ *
+ *   surface_commit(window)            a client committed a surface
+ *   frame(window, rendered)           the scene was rendered, or not
+ *   dump(window, pages, in_flight)    MSG_WINDOW_DUMP sent
+ *   damage(window, x, y, w, h)        MSG_SHMIMAGE sent
+ *   send(window, type, len)           message handed to the vchan
+ *   receive(window, type, len, time)  message from the daemon, daemon time
+ *   dump_ack(window, latency_us)      MSG_WINDOW_DUMP_ACK received
+ */
+
+#include "common.h"
+
+#ifdef QUBES_HAS_SDT
+#include <sys/sdt.h>
+#define QUBES_TRACE(...) STAP_PROBEV(qubes, __VA_ARGS__)
+#else
+#define QUBES_TRACE(...)                                                       \
+	do {                                                                        \
+	} while (0)
+#endif
+
+#endif
+// vim: set noet ts=3 sts=3 sw=3 ft=c fenc=UTF-8:
@@ -21,6 +21,7 @@
 #include "main.h"
 #include "qubes_backend.h"
 #include "qubes_output.h"
+#include "qubes_trace.h"
 #include "qubes_wayland.h"
 #include "qubes_xwayland.h"
 
@@ -203,6 +204,12 @@ static void xdg_surface_destroy(struct wl_listener *listener,
 		wl_list_remove(&view->set_app_id.link);
 		wl_list_remove(&view->ack_configure.link);
 	}
+	if (view->configure_timer) {
+		wl_event_source_remove(view->configure_timer);
+		view->configure_timer = NULL;
+	}
+	if (qubes_output_park(&view->output, sizeof(*view)))
+		return;
 	qubes_output_deinit(&view->output);
 	free(view);
 }
@@ -226,6 +233,7 @@ static void qubes_surface_commit(struct wl_listener *listener,
 	assert(QUBES_VIEW_MAGIC == output->magic);
 	assert(output->scene_output);
 	assert(output->scene_output->output == &output->output);
+	QUBES_TRACE(surface_commit, output->window_id);
 	wlr_xdg_surface_get_geometry(view->xdg_surface, &box);
 	wlr_scene_output_set_position(view->output.scene_output, box.x, box.y);
 	box.x = output->guest.x;
@@ -244,7 +252,7 @@ static void qubes_surface_commit(struct wl_listener *listener,
 		//
 		// Set the surface mode
 		wlr_output_update_custom_mode(&output->output, output->guest.width,
-		                              output->guest.height, 60000);
+		                              output->guest.height, output->refresh);
 		output->guest.width = (unsigned)box.width;
 		output->guest.height = (unsigned)box.height;
 		// Create the surface if necessary
@@ -270,37 +278,88 @@ static void qubes_surface_commit(struct wl_listener *listener,
 		    (surface->toplevel->current.max_height
 		        ? XCB_ICCCM_SIZE_HINT_P_MAX_SIZE
 		        : 0));
-		assert(output->window_id != 0);
-		// clang-format off
-		struct {
-			struct msg_hdr header;
-			struct msg_window_hints hints;
-		} msg = {
-			.header = {
-				.type = MSG_WINDOW_HINTS,
-				.window = output->window_id,
-				.untrusted_len = sizeof(msg.hints),
-			},
-			.hints = {
-				.flags = flags,
-				.min_width = surface->toplevel->current.min_width,
-				.min_height = surface->toplevel->current.min_height,
-				.max_width = surface->toplevel->current.max_width,
-				.max_height = surface->toplevel->current.max_height,
-				.width_inc = 0,
-				.height_inc = 0,
-				.base_width = 0,
-				.base_height = 0,
-			},
+		struct msg_window_hints hints = {
+			.flags = flags,
+			.min_width = surface->toplevel->current.min_width,
+			.min_height = surface->toplevel->current.min_height,
+			.max_width = surface->toplevel->current.max_width,
+			.max_height = surface->toplevel->current.max_height,
+			.width_inc = 0,
+			.height_inc = 0,
+			.base_width = 0,
+			.base_height = 0,
 		};
-		// clang-format on
-		QUBES_STATIC_ASSERT(sizeof msg == sizeof msg.header + sizeof msg.hints);
-		qubes_rust_send_message(output->server->backend->rust_backend,
-		                        (struct msg_hdr *)&msg);
+		qubes_output_send_hints(output, &hints);
 	}
 	wlr_output_send_frame(&output->output);
 }
 
+enum {
+	/* How long a client has to acknowledge a size from the GUI daemon */
+	QUBES_CONFIGURE_ACK_TIMEOUT_MS = 1000,
+};
+
+/* Take the latest size from the daemon, if a configure skipped it */
+static bool qubes_view_take_host_size(struct tinywl_view *view)
+{
+	struct qubes_output *output = &view->output;
+	if (!(output->flags & QUBES_OUTPUT_RESIZE_PENDING))
+		return false;
+	output->flags &= ~QUBES_OUTPUT_RESIZE_PENDING;
+	if (output->host.width == output->guest.width &&
+	    output->host.height == output->guest.height)
+		return false;
+	output->flags |= QUBES_OUTPUT_NEED_CONFIGURE | QUBES_OUTPUT_DAMAGE_ALL;
+	output->guest.width = output->host.width;
+	output->guest.height = output->host.height;
+	wlr_output_update_custom_mode(&output->output, output->guest.width,
+	                              output->guest.height, output->refresh);
+	wlr_output_schedule_frame(&output->output);
+	return true;
+}
+
+static int qubes_view_configure_timeout(void *data)
+{
+	struct tinywl_view *view = data;
+	struct qubes_output *output = &view->output;
+	assert(QUBES_VIEW_MAGIC == output->magic);
+	if (!(output->flags & QUBES_OUTPUT_IGNORE_CLIENT_RESIZE))
+		return 0;
+	wlr_log(WLR_DEBUG,
+	        "Client did not ACK configure with serial %u of window %u in time",
+	        view->configure_serial, output->window_id);
+	if (qubes_view_take_host_size(view))
+		view->configure_serial = wlr_xdg_toplevel_set_size(
+		   view->xdg_surface->toplevel, output->guest.width,
+		   output->guest.height);
+	output->flags &= ~QUBES_OUTPUT_IGNORE_CLIENT_RESIZE;
+	qubes_send_configure(output);
+	return 0;
+}
+
+void qubes_view_set_size(struct tinywl_view *view)
+{
+	struct qubes_output *output = &view->output;
+	assert(QUBES_VIEW_MAGIC == output->magic);
+	assert(view->xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL);
+	output->flags |= QUBES_OUTPUT_IGNORE_CLIENT_RESIZE;
+	view->configure_serial = wlr_xdg_toplevel_set_size(
+	   view->xdg_surface->toplevel, output->guest.width, output->guest.height);
+	wlr_log(WLR_DEBUG,
+	        "Will ACK configure from GUI daemon (width %u, height %u)"
+	        " when client ACKS configure with serial %u",
+	        output->guest.width, output->guest.height, view->configure_serial);
+	if (!view->configure_timer &&
+	    !(view->configure_timer = wl_event_loop_add_timer(
+	         wl_display_get_event_loop(output->server->wl_display),
+	         qubes_view_configure_timeout, view))) {
+		wlr_log(WLR_ERROR, "Cannot create configure timer, will wait for ACK");
+		return;
+	}
+	wl_event_source_timer_update(view->configure_timer,
+	                             QUBES_CONFIGURE_ACK_TIMEOUT_MS);
+}
+
 static void qubes_toplevel_ack_configure(struct wl_listener *listener,
                                          void *data)
 {
@@ -310,11 +369,19 @@ static void qubes_toplevel_ack_configure(struct wl_listener *listener,
 
 	assert(QUBES_VIEW_MAGIC == output->magic);
 
-	if ((output->flags & QUBES_OUTPUT_IGNORE_CLIENT_RESIZE) &&
-	    (view->configure_serial == configure->serial)) {
-		output->flags &= ~QUBES_OUTPUT_IGNORE_CLIENT_RESIZE;
-		qubes_send_configure(output);
+	/* Acknowledging a later configure acknowledges this one too */
+	if (!(output->flags & QUBES_OUTPUT_IGNORE_CLIENT_RESIZE) ||
+	    (int32_t)(configure->serial - view->configure_serial) < 0)
+		return;
+	/* Skip the sizes the daemon went through in the meantime */
+	if (qubes_view_take_host_size(view)) {
+		qubes_view_set_size(view);
+		return;
 	}
+	output->flags &= ~QUBES_OUTPUT_IGNORE_CLIENT_RESIZE;
+	if (view->configure_timer)
+		wl_event_source_timer_update(view->configure_timer, 0);
+	qubes_send_configure(output);
 }
 
 void qubes_new_xdg_surface(struct wl_listener *listener, void *data)
@@ -335,7 +402,9 @@ void qubes_new_xdg_surface(struct wl_listener *listener, void *data)
 	bool is_override_redirect = xdg_surface->role == WLR_XDG_SURFACE_ROLE_POPUP;
 
 	/* Allocate a tinywl_view for this surface */
-	struct tinywl_view *view = calloc(1, sizeof(struct tinywl_view));
+	QUBES_STATIC_ASSERT(offsetof(struct tinywl_view, output) == 0);
+	struct tinywl_view *view = qubes_output_alloc_view(
+	   server, QUBES_VIEW_MAGIC, sizeof(*view), is_override_redirect);
 	if (!view)
 		goto cleanup;
 
@@ -428,7 +497,7 @@ void qubes_new_xdg_surface(struct wl_listener *listener, void *data)
 
 	/* Tell GUI daemon to create window */
 	wlr_output_update_custom_mode(&output->output, output->guest.width,
-	                              output->guest.height, 60000);
+	                              output->guest.height, output->refresh);
 	return;
 cleanup:
 	wl_resource_post_no_memory(xdg_surface->resource);
@@ -25,6 +25,19 @@ struct tinywl_view {
 	struct wl_listener ack_configure;
 
 	uint32_t configure_serial;
+	/* Stops waiting for the client, see qubes_view_set_size() */
+	struct wl_event_source *configure_timer;
 };
 void qubes_view_map(struct tinywl_view *view);
+/*
+ * Send the guest size of a toplevel to its client, and ignore resizes by the
+ * client until it acknowledges that configure.  While it is in flight, newer
+ * sizes from the GUI daemon only replace the host size, and the latest one
+ * is sent when the client acknowledges.  This keeps at most one configure in
+ * flight, so an interactive resize in dom0 does not queue a configure, a
+ * buffer and a dump for every intermediate size.  A client that does not
+ * acknowledge within QUBES_CONFIGURE_ACK_TIMEOUT_MS is sent the latest size
+ * anyway, and the daemon gets its MSG_CONFIGURE, as for Xwayland.
+ */
+void qubes_view_set_size(struct tinywl_view *view);
 void qubes_new_xdg_surface(struct wl_listener *listener, void *data);
@@ -6,6 +6,7 @@
 
 #include "main.h"
 #include "qubes_backend.h"
+#include "qubes_trace.h"
 #include "qubes_xwayland.h"
 
 #ifndef WINDOW_FLAG_MAXIMIZE
@@ -51,6 +52,8 @@ static void xwayland_surface_destroy(struct wl_listener *listener,
 	wl_list_remove(&view->set_parent.link);
 	if (view->commit.link.next)
 		wl_list_remove(&view->commit.link);
+	if (qubes_output_park(&view->output, sizeof(*view)))
+		return;
 	qubes_output_deinit(&view->output);
 	memset(view, 0xFF, sizeof *view);
 	free(view);
@@ -286,33 +289,20 @@ static void xwayland_surface_set_hints(struct wl_listener *listener, void *data)
 	   (XCB_ICCCM_SIZE_HINT_US_POSITION | XCB_ICCCM_SIZE_HINT_P_POSITION |
 	    XCB_ICCCM_SIZE_HINT_P_MIN_SIZE | XCB_ICCCM_SIZE_HINT_P_MAX_SIZE |
 	    XCB_ICCCM_SIZE_HINT_P_RESIZE_INC | XCB_ICCCM_SIZE_HINT_BASE_SIZE);
-	assert(view->output.window_id != 0);
 	// clang-format off
-	struct {
-		struct msg_hdr header;
-		struct msg_window_hints hints;
-	} msg = {
-		.header = {
-			 .type = MSG_WINDOW_HINTS,
-			 .window = view->output.window_id,
-			 .untrusted_len = sizeof(msg.hints),
-		},
-		.hints = hints ? (struct msg_window_hints) {
-			.flags = hints->flags & allowed_flags,
-			.min_width = hints->min_width,
-			.min_height = hints->min_height,
-			.max_width = hints->max_width,
-			.max_height = hints->max_height,
-			.width_inc = hints->width_inc,
-			.height_inc = hints->height_inc,
-			.base_width = hints->base_width,
-			.base_height = hints->base_height,
-		 } : (struct msg_window_hints) { 0 },
-	};
+	struct msg_window_hints msg_hints = hints ? (struct msg_window_hints) {
+		.flags = hints->flags & allowed_flags,
+		.min_width = hints->min_width,
+		.min_height = hints->min_height,
+		.max_width = hints->max_width,
+		.max_height = hints->max_height,
+		.width_inc = hints->width_inc,
+		.height_inc = hints->height_inc,
+		.base_width = hints->base_width,
+		.base_height = hints->base_height,
+	} : (struct msg_window_hints) { 0 };
 	// clang-format on
-	QUBES_STATIC_ASSERT(sizeof msg == sizeof msg.header + sizeof msg.hints);
-	qubes_rust_send_message(view->output.server->backend->rust_backend,
-				(struct msg_hdr *)&msg);
+	qubes_output_send_hints(&view->output, &msg_hints);
 }
 
 static void xwayland_surface_set_override_redirect(struct wl_listener *listener,
@@ -342,11 +332,26 @@ static void qubes_xwayland_surface_commit(struct wl_listener *listener,
 	assert(QUBES_XWAYLAND_MAGIC == output->magic);
 	assert(output->scene_output);
 	assert(output->scene_output->output == &output->output);
+	QUBES_TRACE(surface_commit, output->window_id);
 	surface = view->xwayland_surface;
 	if (!xwayland_get_box(surface, &box)) {
 		wlr_log(WLR_ERROR, "NO BOX");
 		return;
 	}
+	/*
+	 * Most commits only change pixels.  The scene has already damaged them
+	 * and scheduled a frame, so going through qubes_output_configure() would
+	 * only force an extra frame past the frame pacing.  Geometry changes from
+	 * set_geometry and request_configure still take the slow path, and so
+	 * does the first commit after a MSG_CONFIGURE, which updates guest but
+	 * leaves the output mode to qubes_output_configure().
+	 */
+	if (qubes_output_created(output) && box.x == output->guest.x &&
+	    box.y == output->guest.y && box.width == output->output.width &&
+	    box.height == output->output.height &&
+	    (uint32_t)box.width == output->guest.width &&
+	    (uint32_t)box.height == output->guest.height)
+		return;
 	qubes_output_configure(output, box);
 }
 
@@ -393,7 +398,10 @@ void qubes_xwayland_new_xwayland_surface(struct wl_listener *listener,
 	assert(surface);
 	assert(QUBES_SERVER_MAGIC == server->magic);
 
-	struct qubes_xwayland_view *view = calloc(1, sizeof(*view));
+	QUBES_STATIC_ASSERT(offsetof(struct qubes_xwayland_view, output) == 0);
+	struct qubes_xwayland_view *view =
+	   qubes_output_alloc_view(server, QUBES_XWAYLAND_MAGIC, sizeof(*view),
+	                           surface->override_redirect);
 	if (!view) {
 		wlr_log(WLR_ERROR, "Could not allocate view for Xwayland surface");
 		return;
@@ -1,12 +1,18 @@
 use qubes_gui::WindowID;
 use std::{
-    collections::BTreeMap,
-    convert::TryInto,
+    collections::VecDeque,
+    fs::File,
+    io::{Read, Write},
     num::NonZeroU32,
-    os::raw::{c_int, c_void},
-    os::unix::io::AsRawFd,
+    os::raw::{c_int, c_short, c_uint, c_ulong, c_void},
+    os::unix::io::{AsRawFd, FromRawFd, RawFd},
     ptr,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        mpsc, Arc, Condvar, Mutex,
+    },
     task::Poll,
+    thread,
 };
 
 pub const OUTPUT_NAME: &str = "qubes";
@@ -28,41 +34,513 @@ pub const OUTPUT_NAME: &str = "qubes";
 // silently ignored.  This keeps the C code simple and ensures that no messages
 // are sent until the C code has recreated all of the windows.
 
-pub struct QubesData {
-    enabled: bool, // See NOTE: Enabling and disabling GUI messages
-    pub agent: qubes_gui_connection::Connection,
-    wid: u32,
-    pub map: BTreeMap<NonZeroU32, *mut c_void>,
+// NOTE: Message batching
+//
+// A single event loop iteration usually produces several messages: a commit
+// produces MSG_WINDOW_DUMP, MSG_SHMIMAGE, and MSG_WINDOW_HINTS, and a
+// reconnect produces CREATE/CONFIGURE/DUMP/MAP for every window.  Instead of
+// writing each of them to the vchan as soon as it is produced, messages are
+// appended to `QubesData::batch`.  The first message of a batch calls the
+// flush callback registered by the C code, which arranges for
+// `qubes_rust_flush` to be called once the current event loop iteration is
+// done.  The whole batch then goes out in a single vchan write.  If no
+// callback is registered, or it fails, the batch is flushed immediately.
+// Large messages, such as big MSG_WINDOW_DUMPs, are not worth batching and
+// would only be copied needlessly.  They flush the current batch to keep
+// messages in order and are then written directly.
+//
+// Clipboard data is the exception.  The protocol requires a selection to be
+// sent as a single MSG_CLIPBOARD_DATA, and nothing can be written to the
+// vchan until all of it has been, so it would delay every damage and input
+// reply behind it.  It does not refer to any window, so it can safely be
+// reordered: `qubes_rust_send_bulk` takes over the buffer the C code read it
+// into, keeps it in `QubesData::bulk`, and writes it after the batch of the
+// iteration in which it was sent.  That only keeps it from getting ahead of
+// the messages already batched: the write itself still blocks until the ring
+// has taken all of it.
+
+/// Messages at least this large bypass the batch.  See NOTE: Message batching.
+const BATCH_BYPASS_LEN: usize = 1 << 16;
+
+// NOTE: Window ID allocation
+//
+// Every message from the GUI daemon carries a window ID that must be mapped
+// to the C object for that window, so the lookup must be fast.  Window IDs
+// are indexes (plus one) into a dense table.  An ID is not reused as soon as
+// the C code destroys its window: the daemon may still send messages for the
+// window until it has processed our MSG_DESTROY, after which it sends a
+// MSG_DESTROY of its own.  Only then is the ID put on the free list, so a
+// message can never reach a window that merely inherited the ID of an older
+// one.  Free IDs are reused in FIFO order, and the table never grows larger
+// than the largest number of windows that existed at the same time.
+//
+// A daemon that went away will never send its MSG_DESTROY.  A window
+// destroyed while the connection is disabled is freed at once, since its
+// MSG_DESTROY is dropped, and every ID still waiting for an acknowledgement
+// is freed on reconnect.
+
+/// State of one window ID.  See NOTE: Window ID allocation.
+#[derive(Copy, Clone)]
+enum Slot {
+    /// Not in use, and on the free list
+    Free,
+    /// In use by the window with this userdata
+    Live(*mut c_void),
+    /// MSG_DESTROY has been sent, but the daemon has not acknowledged it
+    Destroyed,
+}
+
+#[derive(Default)]
+pub struct WindowTable {
+    slots: Vec<Slot>,
+    free: VecDeque<u32>,
+}
+
+impl WindowTable {
+    fn slot(&mut self, id: NonZeroU32) -> Option<&mut Slot> {
+        self.slots.get_mut(id.get() as usize - 1)
+    }
+
+    fn insert(&mut self, userdata: *mut c_void) -> NonZeroU32 {
+        let index = match self.free.pop_front() {
+            Some(index) => index,
+            None => {
+                let index = self.slots.len();
+                assert!(index < u32::MAX as usize, "out of window IDs");
+                self.slots.push(Slot::Free);
+                index as u32
+            }
+        };
+        self.slots[index as usize] = Slot::Live(userdata);
+        NonZeroU32::new(index + 1).expect("index is less than u32::MAX; qed")
+    }
+
+    fn get(&self, id: NonZeroU32) -> Option<*mut c_void> {
+        match self.slots.get(id.get() as usize - 1) {
+            Some(&Slot::Live(userdata)) => Some(userdata),
+            _ => None,
+        }
+    }
+
+    fn mark_destroyed(&mut self, id: NonZeroU32) {
+        match self.slot(id) {
+            Some(slot @ Slot::Live(_)) => *slot = Slot::Destroyed,
+            Some(Slot::Destroyed) => panic!("delete_id called twice"),
+            _ => panic!("Bogus call to delete_id: ID not found in map!"),
+        }
+    }
+
+    /// The C code destroyed a window.  If the daemon will see the MSG_DESTROY,
+    /// the ID is freed once it acknowledges it; otherwise it is freed now.
+    fn destroy(&mut self, id: NonZeroU32, connected: bool) {
+        self.mark_destroyed(id);
+        if !connected {
+            assert!(self.acknowledge_destroy(id));
+        }
+    }
+
+    /// Free every ID whose MSG_DESTROY went to a daemon that is gone
+    fn forget_destroyed(&mut self) {
+        for (index, slot) in self.slots.iter_mut().enumerate() {
+            if let Slot::Destroyed = slot {
+                *slot = Slot::Free;
+                self.free.push_back(index as u32);
+            }
+        }
+    }
+
+    /// Handle a MSG_DESTROY from the daemon.  Returns false if no MSG_DESTROY
+    /// was sent for this window, which is a protocol error.
+    fn acknowledge_destroy(&mut self, id: NonZeroU32) -> bool {
+        match self.slot(id) {
+            Some(slot @ Slot::Destroyed) => {
+                *slot = Slot::Free;
+                self.free.push_back(id.get() - 1);
+                true
+            }
+            _ => false,
+        }
+    }
+}
+
+// NOTE: Motion coalescing
+//
+// Replaying a backlog of MSG_MOTION one event at a time costs a scene lookup
+// and a seat notification each, and makes the pointer lag behind the mouse.
+// While draining the vchan, a MSG_MOTION is therefore held back instead of
+// being delivered.  If the next message is another MSG_MOTION for the same
+// window, it replaces the held one; anything else first delivers the held
+// event.  Only runs of motion events are merged, so their order relative to
+// buttons, crossings and key presses is unchanged.  Motion events carry
+// absolute coordinates, so only the latest one of a run matters.
+
+/// Not yet in the qubes-gui crate
+const MSG_WINDOW_DUMP_ACK: u32 = 149;
+
+/// Size of `struct msg_motion`
+const MOTION_LEN: usize = 16;
+
+/// A MSG_MOTION that has been read but not yet delivered.
+/// See NOTE: Motion coalescing.
+struct HeldMotion {
+    window: NonZeroU32,
+    userdata: *mut c_void,
+    delta: u32,
+    hdr: qubes_gui::UntrustedHeader,
+    body: [u8; MOTION_LEN],
+}
+
+// NOTE: Off-thread reading
+//
+// The main thread can spend a long time compositing or handling a big client
+// commit.  If it also had to read the vchan, input from the GUI daemon would
+// wait for it, and the daemon could stall on a full ring.  Instead, a reader
+// thread drains the vchan as soon as it becomes readable.  Each message is
+// copied out of the ring, timestamped, and pushed onto a bounded queue, and
+// an eventfd tells the main loop that the queue is non-empty.  The eventfd is
+// what `qubes_rust_backend_fd` returns, so the C code does not know about any
+// of this.  All parsing that needs the window table, and every callback into
+// C, still happens on the main thread.
+//
+// The connection itself is behind a mutex, as the main thread writes to it and
+// reconnects it.  The reader never holds the mutex while it waits for the vchan
+// or for space in the queue, and it releases the mutex after every message it
+// copies, so writes are only ever delayed by a single message.  The main thread
+// must not hold it while calling into C either, as the C code may send or
+// reconnect, which takes it again.  After an error, the reader pauses until
+// `qubes_rust_reconnect` has set up a new connection.  Every event carries the
+// generation of the connection it came from, and the main thread drops anything
+// older than the current one.
+
+/// Capacity of the queue between the reader thread and the main thread.
+/// This is also the most events delivered in one main loop iteration.
+const READER_QUEUE_LEN: usize = 1024;
+
+/// How long the reader waits for the vchan before checking whether it must
+/// stop or the connection changed.
+const READER_POLL_MS: c_int = 100;
+
+#[repr(C)]
+struct PollFd {
+    fd: c_int,
+    events: c_short,
+    revents: c_short,
+}
+
+/// `sigset_t` in glibc
+#[repr(C)]
+struct SigSet([u64; 16]);
+
+extern "C" {
+    fn poll(fds: *mut PollFd, nfds: c_ulong, timeout: c_int) -> c_int;
+    fn eventfd(initval: c_uint, flags: c_int) -> c_int;
+    fn sigfillset(set: *mut SigSet) -> c_int;
+    fn pthread_sigmask(how: c_int, set: *const SigSet, old: *mut SigSet) -> c_int;
+    fn free(ptr: *mut c_void);
+}
+
+const POLLIN: c_short = 0x1;
+const EFD_NONBLOCK: c_int = 0o4000;
+const EFD_CLOEXEC: c_int = 0o2000000;
+const SIG_SETMASK: c_int = 2;
+
+/// Wait up to `timeout` milliseconds for `fd` and return its `revents`, or 0
+/// on timeout or error.
+fn poll_fd(fd: RawFd, timeout: c_int) -> c_short {
+    let mut pollfd = PollFd {
+        fd,
+        events: POLLIN,
+        revents: 0,
+    };
+    match unsafe { poll(&mut pollfd, 1, timeout) } {
+        1 => pollfd.revents,
+        _ => 0,
+    }
+}
+
+/// Something the reader thread found on the vchan.
+/// See NOTE: Off-thread reading.
+enum Event {
+    /// A message from the GUI daemon, and when it was read
+    Message {
+        hdr: qubes_gui::UntrustedHeader,
+        body: Vec<u8>,
+        delta: u32,
+    },
+    /// A new connection is ready.  `version` is the daemon's protocol version.
+    Reconnected {
+        version: qubes_gui::WindowID,
+        delta: u32,
+    },
+    /// The connection failed.  The reader is paused until the next reconnect.
+    Error { needs_reconnect: bool },
+}
+
+/// Connection state shared with the reader thread.  Protected by
+/// `Shared::link`.
+struct Link {
+    agent: qubes_gui_connection::Connection,
+    /// The reader must wait for `qubes_rust_reconnect`
+    paused: bool,
+    /// The reader must exit
+    stop: bool,
+}
+
+// SAFETY: the connection is only ever used with the mutex held, so from one
+// thread at a time.
+unsafe impl Send for Link {}
+
+struct Shared {
+    link: Mutex<Link>,
+    /// Signalled when `paused` or `stop` is cleared or set
+    wake: Condvar,
+    /// Bumped with `link` locked on every reconnect
+    generation: AtomicU64,
+    /// Readable while the queue may be non-empty
+    eventfd: File,
+}
+
+impl Shared {
+    fn lock(&self) -> std::sync::MutexGuard<'_, Link> {
+        self.link.lock().expect("reader thread panicked")
+    }
+
+    fn notify_main(&self) {
+        // Fails only if the counter would overflow, and then it is readable
+        let _ = (&self.eventfd).write(&1u64.to_ne_bytes());
+    }
+}
+
+impl Link {
+    /// Copy at most one message out of the ring into `events`.  Returns false
+    /// if there may be more to read.  Called with the mutex held.
+    fn read_event(&mut self, start: std::time::Instant, events: &mut Vec<Event>) -> bool {
+        let agent = &mut self.agent;
+        if agent.needs_reconnect() {
+            self.paused = true;
+            events.push(Event::Error {
+                needs_reconnect: true,
+            });
+            return true;
+        }
+        // The main thread may have consumed the notification in the meantime,
+        // so only wait for it if it is still pending.  Only the first read of
+        // a drain needs to.
+        if events.is_empty() && poll_fd(agent.as_raw_fd(), 0) & POLLIN != 0 {
+            agent.wait();
+        }
+        let delta = (std::time::Instant::now() - start).as_millis() as u32;
+        match agent.read_message() {
+            Poll::Ready(Ok(buffer)) => {
+                let (hdr, body) = (buffer.hdr(), buffer.body());
+                assert_eq!(hdr.len(), body.len());
+                events.push(Event::Message {
+                    hdr: hdr.inner(),
+                    body: body.to_vec(),
+                    delta,
+                });
+                false
+            }
+            Poll::Pending => {
+                if agent.reconnected() {
+                    events.push(Event::Reconnected {
+                        version: qubes_gui::WindowID {
+                            window: qubes_castable::cast!(agent.xconf().version),
+                        },
+                        delta,
+                    });
+                }
+                true
+            }
+            Poll::Ready(Err(_)) => {
+                let needs_reconnect = agent.needs_reconnect();
+                self.paused = true;
+                events.push(Event::Error { needs_reconnect });
+                true
+            }
+        }
+    }
+}
+
+fn reader_main(
+    shared: Arc<Shared>,
+    queue: mpsc::SyncSender<(u64, Event)>,
     start: std::time::Instant,
+) {
+    let mut events = Vec::with_capacity(READER_QUEUE_LEN);
+    // Read once before waiting for each new connection, as the notification
+    // may have come before the reader saw it.
+    let mut last_generation = None;
+    let mut drained = true;
+    loop {
+        let (fd, generation) = {
+            let mut link = shared.lock();
+            while link.paused && !link.stop {
+                link = shared.wake.wait(link).expect("main thread panicked");
+            }
+            if link.stop {
+                return;
+            }
+            (
+                link.agent.as_raw_fd(),
+                shared.generation.load(Ordering::Relaxed),
+            )
+        };
+        if drained && last_generation == Some(generation) && poll_fd(fd, READER_POLL_MS) == 0 {
+            continue;
+        }
+        last_generation = Some(generation);
+        // Lock once per message, so a send from the main thread is never
+        // stuck behind a whole drain of the ring.
+        loop {
+            let mut link = shared.lock();
+            if link.stop {
+                return;
+            }
+            if link.paused || shared.generation.load(Ordering::Relaxed) != generation {
+                break;
+            }
+            drained = link.read_event(start, &mut events);
+            drop(link);
+            if drained || events.len() >= READER_QUEUE_LEN {
+                break;
+            }
+        }
+        if events.is_empty() {
+            continue;
+        }
+        for event in events.drain(..) {
+            // Make sure the main thread is draining before blocking on it
+            let event = match queue.try_send((generation, event)) {
+                Ok(()) => continue,
+                Err(mpsc::TrySendError::Full(event)) => event,
+                Err(mpsc::TrySendError::Disconnected(_)) => return,
+            };
+            shared.notify_main();
+            if queue.send(event).is_err() {
+                return;
+            }
+        }
+        shared.notify_main();
+    }
+}
+
+/// Called when a batch becomes non-empty.  Returns true if the C code will
+/// call `qubes_rust_flush` later.
+pub type FlushCallback = unsafe extern "C" fn(*mut c_void) -> bool;
+
+pub struct QubesData {
+    enabled: bool,       // See NOTE: Enabling and disabling GUI messages
+    shared: Arc<Shared>, // See NOTE: Off-thread reading
+    queue: mpsc::Receiver<(u64, Event)>,
+    reader: thread::JoinHandle<()>,
+    pub windows: WindowTable,     // See NOTE: Window ID allocation
+    batch: Vec<u8>,               // See NOTE: Message batching
+    bulk: VecDeque<MallocBuffer>, // See NOTE: Message batching
+    flush_callback: Option<(FlushCallback, *mut c_void)>,
+    coalesced_motion: u64, // See NOTE: Motion coalescing
 }
 
 impl QubesData {
+    /// Append a message to the current batch.  See NOTE: Message batching.
+    fn send_message(&mut self, message: &[u8]) {
+        if message.len() >= BATCH_BYPASS_LEN {
+            self.flush();
+            if self.enabled {
+                let _ = self.shared.lock().agent.send_raw_bytes(message);
+            }
+            return;
+        }
+        let was_empty = self.batch.is_empty() && self.bulk.is_empty();
+        self.batch.extend_from_slice(message);
+        if was_empty {
+            self.schedule_flush()
+        }
+    }
+
+    /// Queue clipboard data to be written after the current batch.  See
+    /// NOTE: Message batching.
+    fn send_bulk(&mut self, message: MallocBuffer) {
+        let was_empty = self.batch.is_empty() && self.bulk.is_empty();
+        self.bulk.push_back(message);
+        if was_empty {
+            self.schedule_flush()
+        }
+    }
+
+    fn schedule_flush(&mut self) {
+        let scheduled = match self.flush_callback {
+            Some((callback, userdata)) => unsafe { callback(userdata) },
+            None => false,
+        };
+        if !scheduled {
+            self.flush()
+        }
+    }
+
+    /// Send every batched message in one write, followed by any clipboard
+    /// data.  Messages batched while the connection was disabled are dropped.
+    fn flush(&mut self) {
+        if self.batch.is_empty() && self.bulk.is_empty() {
+            return;
+        }
+        if self.enabled {
+            let mut link = self.shared.lock();
+            if !self.batch.is_empty() {
+                let _ = link.agent.send_raw_bytes(&self.batch);
+            }
+            for message in &self.bulk {
+                let _ = link.agent.send_raw_bytes(&message[..]);
+            }
+        }
+        self.batch.clear();
+        self.bulk.clear();
+    }
+
     fn id(&mut self, userdata: *mut c_void) -> NonZeroU32 {
-        let id = self.wid;
-        self.wid = id
-            .checked_add(1)
-            .expect("not yet implemented: wid wrapping");
-        let id = id
-            .try_into()
-            .expect("IDs start at 1 and do not wrap, so they cannot be zero; qed");
-        assert!(self.map.insert(id, userdata).is_none());
-        id
+        self.windows.insert(userdata)
     }
 
     fn destroy_id(&mut self, WindowID { window }: WindowID) {
         if let Some(id) = window {
-            let v = self
-                .map
-                .get_mut(&id)
-                .expect("Bogus call to delete_id: ID not found in map!");
-            assert!(!(*v).is_null(), "delete_id called twice");
-            *v = ptr::null_mut();
+            self.windows.destroy(id, self.enabled)
         }
     }
 
+    /// Replace the connection with a new one, and let the reader thread use
+    /// it.  See NOTE: Off-thread reading.
+    fn reconnect(&mut self) -> bool {
+        // Anything still batched was meant for the old connection
+        self.batch.clear();
+        self.bulk.clear();
+        // The new daemon never saw these windows
+        self.windows.forget_destroyed();
+        let mut link = self.shared.lock();
+        self.shared.generation.fetch_add(1, Ordering::Relaxed);
+        let ok = link.agent.reconnect().is_ok();
+        link.paused = !ok;
+        self.shared.wake.notify_one();
+        ok
+    }
+
+    /// Stop the reader thread and wait for it to exit
+    fn stop(self) {
+        let Self {
+            shared,
+            queue,
+            reader,
+            ..
+        } = self;
+        shared.lock().stop = true;
+        shared.wake.notify_one();
+        // Unblocks the reader if the queue is full
+        drop(queue);
+        reader.join().expect("reader thread panicked");
+    }
+
     unsafe fn on_fd_ready(
         &mut self,
-        is_readable: bool,
+        _is_readable: bool,
         callback: unsafe extern "C" fn(
             *mut c_void,
             *mut c_void,
@@ -72,88 +550,107 @@ impl QubesData {
         ),
         global_userdata: *mut c_void,
     ) {
+        let mut count = [0; 8];
+        // Fails if the eventfd was already reset, which is harmless
+        let _ = (&self.shared.eventfd).read(&mut count);
         let Self {
-            ref mut agent,
+            ref shared,
+            ref queue,
             ref mut enabled,
             ..
         } = self;
-        let mut protocol_error = |agent: &qubes_gui_connection::Connection| {
+        let protocol_error = |enabled: &mut bool, needs_reconnect: bool| {
             *enabled = false;
             let hdr = qubes_gui::UntrustedHeader {
                 ty: 0,
                 window: qubes_gui::WindowID { window: None },
-                untrusted_len: if agent.needs_reconnect() { 1 } else { 3 },
+                untrusted_len: if needs_reconnect { 1 } else { 3 },
             };
             callback(global_userdata, ptr::null_mut(), 0, hdr, ptr::null())
         };
-        if agent.needs_reconnect() {
-            protocol_error(agent);
-            return;
-        }
-        if is_readable {
-            agent.wait();
-        }
-        loop {
-            let res = agent.read_message();
-            match res {
-                Poll::Ready(Ok(buffer)) => {
-                    let (hdr, body) = (buffer.hdr(), buffer.body());
-                    assert_eq!(hdr.len(), body.len());
-                    let delta = (std::time::Instant::now() - self.start).as_millis() as u32;
-                    if let Some(nz) = hdr.untrusted_window().window {
-                        if hdr.ty() == qubes_gui::MSG_DESTROY {
-                            use std::collections::btree_map::Entry;
-                            let p = self.map.entry(nz);
-                            match p {
-                                Entry::Vacant(_) => protocol_error(agent),
-                                Entry::Occupied(e) => match e.remove_entry() {
-                                    (_, v) if v.is_null() => {}
-                                    _ => protocol_error(agent),
-                                },
-                            }
-                        } else if let Some(&userdata) = self.map.get(&nz) {
-                            if !userdata.is_null() {
-                                callback(
-                                    global_userdata,
+        let deliver = |held: Option<HeldMotion>| {
+            if let Some(m) = held {
+                callback(global_userdata, m.userdata, m.delta, m.hdr, m.body.as_ptr())
+            }
+        };
+        let mut held: Option<HeldMotion> = None;
+        let mut more = true;
+        for _ in 0..READER_QUEUE_LEN {
+            let (generation, event) = match queue.try_recv() {
+                Ok(event) => event,
+                Err(_) => {
+                    more = false;
+                    break;
+                }
+            };
+            // The callback may have reconnected, so check for every event
+            if generation != shared.generation.load(Ordering::Relaxed) {
+                continue;
+            }
+            match event {
+                Event::Message { hdr, body, delta } => {
+                    if let Some(nz) = hdr.window.window {
+                        if hdr.ty == qubes_gui::MSG_MOTION && body.len() == MOTION_LEN {
+                            if let Some(userdata) = self.windows.get(nz) {
+                                match held {
+                                    Some(ref m) if m.window == nz => self.coalesced_motion += 1,
+                                    _ => deliver(held.take()),
+                                }
+                                let mut motion = [0; MOTION_LEN];
+                                motion.copy_from_slice(&body);
+                                held = Some(HeldMotion {
+                                    window: nz,
                                     userdata,
                                     delta,
-                                    hdr.inner(),
-                                    body.as_ptr(),
-                                )
+                                    hdr,
+                                    body: motion,
+                                });
+                                continue;
+                            }
+                        }
+                    }
+                    deliver(held.take());
+                    if let Some(nz) = hdr.window.window {
+                        if hdr.ty == qubes_gui::MSG_DESTROY {
+                            if !self.windows.acknowledge_destroy(nz) {
+                                // The guard must be gone before the callback,
+                                // which may reconnect and take the lock again.
+                                let needs_reconnect = shared.lock().agent.needs_reconnect();
+                                protocol_error(enabled, needs_reconnect)
                             }
+                        } else if let Some(userdata) = self.windows.get(nz) {
+                            callback(global_userdata, userdata, delta, hdr, body.as_ptr())
+                        } else if hdr.ty == MSG_WINDOW_DUMP_ACK {
+                            // The C code must release the buffer even if the
+                            // window is already gone.
+                            callback(global_userdata, ptr::null_mut(), delta, hdr, body.as_ptr())
                         }
                     } else {
-                        callback(
-                            global_userdata,
-                            ptr::null_mut(),
-                            delta,
-                            hdr.inner(),
-                            body.as_ptr(),
-                        );
+                        callback(global_userdata, ptr::null_mut(), delta, hdr, body.as_ptr());
                     }
                 }
-                Poll::Pending => {
-                    if agent.reconnected() {
-                        *enabled = true;
-                        let hdr = qubes_gui::UntrustedHeader {
-                            ty: 0,
-                            window: qubes_gui::WindowID {
-                                window: qubes_castable::cast!(agent.xconf().version),
-                            },
-                            untrusted_len: 2,
-                        };
-                        let delta = (std::time::Instant::now() - self.start).as_millis() as u32;
-                        callback(global_userdata, ptr::null_mut(), delta, hdr, ptr::null());
-                    }
-                    break;
+                Event::Reconnected { version, delta } => {
+                    deliver(held.take());
+                    *enabled = true;
+                    let hdr = qubes_gui::UntrustedHeader {
+                        ty: 0,
+                        window: version,
+                        untrusted_len: 2,
+                    };
+                    callback(global_userdata, ptr::null_mut(), delta, hdr, ptr::null());
                 }
-
-                Poll::Ready(Err(_)) => {
-                    protocol_error(agent);
-                    break;
+                Event::Error { needs_reconnect } => {
+                    deliver(held.take());
+                    protocol_error(enabled, needs_reconnect);
                 }
             }
         }
+        deliver(held.take());
+        if more {
+            // Whatever is left waits for the next iteration, so that the main
+            // loop gets to do other work in between.
+            shared.notify_main();
+        }
     }
 }
 
@@ -177,8 +674,8 @@ pub unsafe extern "C" fn qubes_rust_generate_id(
 
 #[no_mangle]
 pub unsafe extern "C" fn qubes_rust_reconnect(backend: *mut c_void) -> bool {
-    match std::panic::catch_unwind(|| (*(backend as *mut RustBackend)).agent.reconnect()) {
-        Ok(e) => e.is_ok(),
+    match std::panic::catch_unwind(|| (*(backend as *mut RustBackend)).reconnect()) {
+        Ok(e) => e,
         Err(_) => {
             drop(std::panic::catch_unwind(|| {
                 eprintln!("Unexpected panic");
@@ -190,7 +687,10 @@ pub unsafe extern "C" fn qubes_rust_reconnect(backend: *mut c_void) -> bool {
 
 #[no_mangle]
 pub unsafe extern "C" fn qubes_rust_backend_fd(backend: *mut c_void) -> c_int {
-    match std::panic::catch_unwind(|| (*(backend as *mut RustBackend)).agent.as_raw_fd()) {
+    match std::panic::catch_unwind(|| {
+        let backend = &*(backend as *mut RustBackend);
+        backend.shared.eventfd.as_raw_fd()
+    }) {
         Ok(e) => e,
         Err(_) => {
             drop(std::panic::catch_unwind(|| {
@@ -240,6 +740,55 @@ pub unsafe extern "C" fn qubes_rust_backend_on_fd_ready(
     }
 }
 
+/// A message allocated by the C code with `malloc()`, and freed once sent
+struct MallocBuffer {
+    ptr: ptr::NonNull<u8>,
+    len: usize,
+}
+
+impl std::ops::Deref for MallocBuffer {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        unsafe { core::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl Drop for MallocBuffer {
+    fn drop(&mut self) {
+        unsafe { free(self.ptr.as_ptr() as *mut c_void) }
+    }
+}
+
+/// Like `qubes_rust_send_message`, but for a message too big to copy, such
+/// as MSG_CLIPBOARD_DATA.  Takes ownership of `header`, which must have been
+/// allocated with `malloc()`.  See NOTE: Message batching.
+#[no_mangle]
+pub unsafe extern "C" fn qubes_rust_send_bulk(
+    backend: &mut RustBackend,
+    header: ptr::NonNull<qubes_gui::UntrustedHeader>,
+) {
+    // untrusted_len is actually trusted here
+    let message = MallocBuffer {
+        ptr: header.cast(),
+        len: header.as_ref().untrusted_len as usize
+            + core::mem::size_of::<qubes_gui::UntrustedHeader>(),
+    };
+    match std::panic::catch_unwind(std::panic::AssertUnwindSafe(|| {
+        // Dropping the message frees it
+        if backend.enabled {
+            backend.send_bulk(message)
+        }
+    })) {
+        Ok(()) => {}
+        Err(_) => {
+            core::mem::forget(std::panic::catch_unwind(|| {
+                eprintln!("Unexpected panic");
+            }));
+            std::process::abort();
+        }
+    }
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn qubes_rust_send_message(
     backend: &mut RustBackend,
@@ -250,16 +799,18 @@ pub unsafe extern "C" fn qubes_rust_send_message(
         header as *const _ as *const u8,
         header.untrusted_len as usize + core::mem::size_of::<qubes_gui::UntrustedHeader>(),
     );
-    if !backend.enabled {
-        return;
-    }
     match std::panic::catch_unwind(std::panic::AssertUnwindSafe(|| {
+        // Even if the message is dropped, the window is gone.  See NOTE:
+        // Window ID allocation.
         if header.ty == qubes_gui::MSG_DESTROY {
             backend.destroy_id(header.window);
         }
-        backend.agent.send_raw_bytes(slice)
+        if !backend.enabled {
+            return;
+        }
+        backend.send_message(slice)
     })) {
-        Ok(_) => {}
+        Ok(()) => {}
         Err(_) => {
             core::mem::forget(std::panic::catch_unwind(|| {
                 eprintln!("Unexpected panic");
@@ -269,21 +820,126 @@ pub unsafe extern "C" fn qubes_rust_send_message(
     }
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn qubes_rust_flush(backend: &mut RustBackend) {
+    match std::panic::catch_unwind(std::panic::AssertUnwindSafe(|| backend.flush())) {
+        Ok(()) => {}
+        Err(_) => {
+            core::mem::forget(std::panic::catch_unwind(|| {
+                eprintln!("Unexpected panic");
+            }));
+            std::process::abort();
+        }
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn qubes_rust_backend_set_flush_callback(
+    backend: &mut RustBackend,
+    callback: Option<FlushCallback>,
+    userdata: *mut c_void,
+) {
+    backend.flush_callback = callback.map(|callback| (callback, userdata))
+}
+
+#[no_mangle]
+pub extern "C" fn qubes_rust_coalesced_motion_events(backend: &RustBackend) -> u64 {
+    backend.coalesced_motion
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn qubes_rust_backend_free(backend: *mut c_void) {
     if !backend.is_null() {
-        drop(Box::from_raw(backend as *mut RustBackend))
+        Box::from_raw(backend as *mut RustBackend).stop()
     }
 }
 
 fn setup_qubes_backend(domid: u16) -> RustBackend {
     let agent = qubes_gui_connection::Connection::agent(domid).unwrap();
     // we now have a agent 🙂
+    let fd = unsafe { eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK) };
+    assert!(fd >= 0, "cannot create eventfd");
+    let shared = Arc::new(Shared {
+        link: Mutex::new(Link {
+            agent,
+            paused: false,
+            stop: false,
+        }),
+        wake: Condvar::new(),
+        generation: AtomicU64::new(0),
+        // SAFETY: the fd was just created and is owned by nobody else
+        eventfd: unsafe { File::from_raw_fd(fd) },
+    });
+    let (sender, queue) = mpsc::sync_channel(READER_QUEUE_LEN);
+    let reader = {
+        let shared = shared.clone();
+        let start = std::time::Instant::now();
+        // Signals must keep going to the main thread's signalfd
+        let mut all = SigSet([0; 16]);
+        let mut old = SigSet([0; 16]);
+        unsafe {
+            assert_eq!(sigfillset(&mut all), 0);
+            assert_eq!(pthread_sigmask(SIG_SETMASK, &all, &mut old), 0);
+        }
+        let reader = thread::Builder::new()
+            .name("vchan reader".to_owned())
+            .spawn(move || {
+                let reader = std::panic::AssertUnwindSafe(|| reader_main(shared, sender, start));
+                if std::panic::catch_unwind(reader).is_err() {
+                    drop(std::panic::catch_unwind(|| {
+                        eprintln!("Error in Rust vchan reader");
+                    }));
+                    std::process::abort();
+                }
+            });
+        unsafe { assert_eq!(pthread_sigmask(SIG_SETMASK, &old, ptr::null_mut()), 0) };
+        reader.expect("cannot create vchan reader thread")
+    };
     QubesData {
-        agent,
         enabled: true,
-        wid: 1,
-        map: Default::default(),
-        start: std::time::Instant::now(),
+        shared,
+        queue,
+        reader,
+        windows: Default::default(),
+        batch: Vec::new(),
+        bulk: VecDeque::new(),
+        flush_callback: None,
+        coalesced_motion: 0,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::WindowTable;
+    use std::os::raw::c_void;
+
+    fn userdata(n: usize) -> *mut c_void {
+        n as *mut c_void
+    }
+
+    #[test]
+    fn destroyed_while_disconnected_is_freed() {
+        let mut table = WindowTable::default();
+        let id = table.insert(userdata(1));
+        table.destroy(id, false);
+        assert_eq!(table.get(id), None);
+        assert!(!table.acknowledge_destroy(id));
+        assert_eq!(table.insert(userdata(2)), id);
+        assert_eq!(table.get(id), Some(userdata(2)));
+    }
+
+    #[test]
+    fn reconnect_frees_unacknowledged_ids() {
+        let mut table = WindowTable::default();
+        let first = table.insert(userdata(1));
+        let second = table.insert(userdata(2));
+        table.destroy(first, true);
+        // Still waiting for the daemon, so not reused
+        let third = table.insert(userdata(3));
+        assert_ne!(third, first);
+        table.forget_destroyed();
+        assert_eq!(table.insert(userdata(4)), first);
+        assert_eq!(table.get(second), Some(userdata(2)));
+        assert_eq!(table.slots.len(), 3);
     }
 }